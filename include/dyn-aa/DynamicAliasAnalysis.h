@@ -7,6 +7,7 @@
 #include "llvm/Pass.h"
 #include "llvm/ADT/DenseSet.h"
 #include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Support/raw_ostream.h"
 
 #include "rcs/typedefs.h"
 
@@ -26,7 +27,7 @@ struct DynamicAliasAnalysis: public ModulePass,
   static char ID;
   static const unsigned UnknownVersion;
 
-  DynamicAliasAnalysis(): ModulePass(ID) {}
+  DynamicAliasAnalysis(): ModulePass(ID), AliasOutput(NULL) {}
   virtual bool runOnModule(Module &M);
   virtual void getAnalysisUsage(AnalysisUsage &AU) const;
 
@@ -41,7 +42,9 @@ struct DynamicAliasAnalysis: public ModulePass,
   void processTopLevel(const TopLevelRecord &Record);
   void processEnter(const EnterRecord &Record);
   void processReturn(const ReturnRecord &Record);
+  void processMemFree(const MemFreeRecord &Record);
   void initialize();
+  void afterCatchingUp();
 
   const DenseSet<rcs::ValuePair> &getAllAliases() const { return Aliases; }
 
@@ -71,8 +74,14 @@ struct DynamicAliasAnalysis: public ModulePass,
   // 2-way mapping indicating the current address of each pointer
   DenseMap<Location, DenseSet<Definition> > PointedBy;
   DenseMap<Definition, Location> PointsTo;
+  // The addresses in PointedBy of each version, so that the pointers to a
+  // freed block can be dropped without scanning PointedBy.
+  DenseMap<unsigned, DenseSet<void *> > AddressesOfVersion;
   // Stores all alias pairs.
   DenseSet<rcs::ValuePair> Aliases;
+  // The file of -output-ng, to which each alias pair is written when it is
+  // found.
+  raw_fd_ostream *AliasOutput;
   // Pointers that ever point to unversioned addresses.
   rcs::ValueSet PointersVersionUnknown;
   // Addresses whose version is unknown.
@@ -81,8 +90,9 @@ struct DynamicAliasAnalysis: public ModulePass,
   // pointer will be associated with the invocation ID to gain
   // context-sensitivity.
   unsigned NumInvocations;
-  // Thread-specific call stack.
-  std::stack<unsigned> CallStack;
+  // Thread-specific call stacks, indexed by the log ID. With -merge-logs,
+  // records of different threads interleave.
+  DenseMap<unsigned, std::stack<unsigned> > CallStacks;
   // Pointers in PointsTo and PointedBy. Indexed by invocation ID so that
   // we can quickly find out what pointers to delete given a function.
   DenseMap<unsigned, std::vector<unsigned> > ActivePointers;
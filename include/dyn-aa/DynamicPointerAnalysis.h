@@ -30,6 +30,7 @@ struct DynamicPointerAnalysis: public ModulePass, public rcs::PointerAnalysis, p
   // Interfaces of LogProcessor.
   void processMemAlloc(const MemAllocRecord &Record);
   void processTopLevel(const TopLevelRecord &Record);
+  void processMemFree(const MemFreeRecord &Record);
 
  private:
   // Returns the value ID of <Addr>'s allocator.
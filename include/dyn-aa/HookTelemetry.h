@@ -0,0 +1,229 @@
+// Per-thread cost counters of the runtimes, i.e. MemoryHooks and
+// AliasChecker, and a dumper that writes them as JSON. The dumper only uses
+// async-signal-safe calls, so that it can run in a SIGUSR2 handler.
+
+#ifndef __DYN_AA_HOOK_TELEMETRY_H
+#define __DYN_AA_HOOK_TELEMETRY_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+
+namespace neongoby {
+struct HookTelemetry {
+  // A cheap monotonic clock: the time stamp counter of the CPU on x86, and
+  // nanoseconds elsewhere.
+  static uint64_t ReadCycleCounter() {
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t Low, High;
+    __asm__ __volatile__("rdtsc" : "=a"(Low), "=d"(High));
+    return ((uint64_t)High << 32) | Low;
+#else
+    struct timespec Now;
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return (uint64_t)Now.tv_sec * 1000000000 + Now.tv_nsec;
+#endif
+  }
+
+  // Timing every hook would cost more than most hooks, so only one in
+  // TimingPeriod calls is timed, and its cycles are counted TimingPeriod
+  // times.
+  static const unsigned TimingPeriod = 64;
+
+  // Installs Handler for Signal, and saves the action it replaces in
+  // Previous. Both runtimes, and the program, may handle the same signal, so
+  // Handler should pass the signal on with ChainSignal.
+  static void InstallSignalHandler(int Signal,
+                                   void (*Handler)(int, siginfo_t *, void *),
+                                   struct sigaction *Previous) {
+    struct sigaction Action;
+    memset(&Action, 0, sizeof Action);
+    Action.sa_sigaction = Handler;
+    sigemptyset(&Action.sa_mask);
+    Action.sa_flags = SA_RESTART | SA_SIGINFO;
+    sigaction(Signal, &Action, Previous);
+  }
+
+  // Calls the handler in Previous, if any. The default action of the
+  // telemetry signal would kill the program, so it is not taken.
+  static void ChainSignal(const struct sigaction &Previous, int Signal,
+                          siginfo_t *Info, void *Context) {
+    if (Previous.sa_flags & SA_SIGINFO) {
+      if (Previous.sa_sigaction)
+        Previous.sa_sigaction(Signal, Info, Context);
+    } else if (Previous.sa_handler != SIG_DFL &&
+               Previous.sa_handler != SIG_IGN) {
+      Previous.sa_handler(Signal);
+    }
+  }
+};
+
+// The counters of one thread. Only the owning thread writes them, so they
+// are plain increments; a dump may read them while they change, which at
+// worst makes a counter one step behind.
+template <unsigned NumCounters>
+struct ThreadCounters {
+  pid_t ThreadID;
+  volatile uint64_t Counts[NumCounters];
+};
+
+// The counters of all threads that have counted something. Threads register
+// themselves on their first count and are never unregistered, so that the
+// counts of finished threads are dumped as well. The registry is a fixed
+// array so that a signal handler can walk it while a thread registers.
+template <unsigned NumCounters>
+struct TelemetryRegistry {
+  typedef ThreadCounters<NumCounters> CountersType;
+  static const unsigned MaxNumThreads = 4096;
+
+  // <Names> has the name of each counter in the dump.
+  TelemetryRegistry(const char *const *Names): Names(Names), NumThreads(0) {
+    FileName[0] = '\0';
+  }
+
+  // Counters of threads beyond MaxNumThreads share the last slot.
+  CountersType *registerThread() {
+    unsigned Index = __sync_fetch_and_add(&NumThreads, 1);
+    if (Index >= MaxNumThreads)
+      return Threads[MaxNumThreads - 1];
+    CountersType *Counters = new CountersType();
+    Counters->ThreadID = syscall(SYS_gettid);
+    memset((void *)Counters->Counts, 0, sizeof Counters->Counts);
+    __sync_synchronize();
+    Threads[Index] = Counters;
+    return Counters;
+  }
+
+  // Drops the counts inherited from the parent, e.g. in a forked child.
+  // Must be called when only one thread is running.
+  void reset() {
+    for (unsigned i = 0; i < MaxNumThreads; ++i)
+      Threads[i] = NULL;
+    NumThreads = 0;
+  }
+
+  void setFileName(const char *Prefix, pid_t ProcessID) {
+    Buffer B(-1);
+    B.append(Prefix);
+    B.append((uint64_t)ProcessID);
+    size_t Length = B.Size;
+    if (Length > sizeof FileName - 1)
+      Length = sizeof FileName - 1;
+    memcpy(FileName, B.Data, Length);
+    FileName[Length] = '\0';
+  }
+
+  // Writes the counters of every thread and their sums to FileName as
+  // {"pid": ..., "threads": [{"tid": ..., <name>: <count>, ...}, ...],
+  //  "total": {<name>: <count>, ...}}.
+  void dump() {
+    if (FileName[0] == '\0')
+      return;
+    int FD = open(FileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (FD == -1)
+      return;
+    Buffer B(FD);
+    B.append("{\"pid\": ");
+    B.append((uint64_t)getpid());
+    B.append(",\n \"threads\": [");
+    uint64_t Total[NumCounters];
+    memset(Total, 0, sizeof Total);
+    unsigned N = NumThreads < MaxNumThreads ? NumThreads : MaxNumThreads;
+    bool First = true;
+    for (unsigned i = 0; i < N; ++i) {
+      // Registered but not yet published.
+      CountersType *Counters = Threads[i];
+      if (!Counters)
+        continue;
+      uint64_t Counts[NumCounters];
+      for (unsigned j = 0; j < NumCounters; ++j) {
+        Counts[j] = Counters->Counts[j];
+        Total[j] += Counts[j];
+      }
+      B.append(First ? "\n  {\"tid\": " : ",\n  {\"tid\": ");
+      B.append((uint64_t)Counters->ThreadID);
+      appendCounts(B, Counts);
+      B.append("}");
+      First = false;
+    }
+    B.append("],\n \"total\": {\"threads\": ");
+    B.append((uint64_t)N);
+    appendCounts(B, Total);
+    B.append("}}\n");
+    B.flush();
+    close(FD);
+  }
+
+ private:
+  // Formats into a fixed buffer, and writes it out when it fills up.
+  struct Buffer {
+    explicit Buffer(int FD): FD(FD), Size(0) {}
+
+    void append(const char *S) {
+      for (; *S; ++S) {
+        if (Size == sizeof Data)
+          flush();
+        Data[Size++] = *S;
+      }
+    }
+
+    void append(uint64_t V) {
+      char Digits[24];
+      unsigned N = 0;
+      do {
+        Digits[N++] = '0' + V % 10;
+        V /= 10;
+      } while (V > 0);
+      char S[24];
+      for (unsigned i = 0; i < N; ++i)
+        S[i] = Digits[N - 1 - i];
+      S[N] = '\0';
+      append(S);
+    }
+
+    void flush() {
+      const char *P = Data;
+      while (FD != -1 && Size > 0) {
+        ssize_t R = write(FD, P, Size);
+        if (R == -1) {
+          if (errno == EINTR)
+            continue;
+          break;
+        }
+        P += R;
+        Size -= R;
+      }
+      Size = 0;
+    }
+
+    int FD;
+    char Data[4096];
+    size_t Size;
+  };
+
+  void appendCounts(Buffer &B, const uint64_t *Counts) {
+    for (unsigned i = 0; i < NumCounters; ++i) {
+      B.append(", \"");
+      B.append(Names[i]);
+      B.append("\": ");
+      B.append(Counts[i]);
+    }
+  }
+
+  const char *const *Names;
+  CountersType *volatile Threads[MaxNumThreads];
+  volatile unsigned NumThreads;
+  char FileName[1024];
+};
+}
+
+#endif
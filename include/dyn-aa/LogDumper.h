@@ -13,6 +13,7 @@ struct LogDumper: public LogProcessor {
   virtual void processCall(const CallRecord &);
   virtual void processReturn(const ReturnRecord &);
   virtual void processBasicBlock(const BasicBlockRecord &);
+  virtual void processMemFree(const MemFreeRecord &);
 };
 }
 
@@ -0,0 +1,509 @@
+// The on-disk format of point-to logs. Shared by the runtime, which encodes
+// LogRecords, and LogProcessor, which decodes them.
+
+#ifndef __DYN_AA_LOG_FORMAT_H
+#define __DYN_AA_LOG_FORMAT_H
+
+#include <stdint.h>
+
+#include <cstring>
+
+#include "dyn-aa/LogRecord.h"
+
+namespace neongoby {
+// Every log written by the current runtime starts with a LogFileHeader. A log
+// without the header is in the legacy format, i.e. a plain sequence of
+// LogRecords. The first byte of a legacy log is a LogRecordType, so it never
+// collides with the magic number.
+struct LogFileHeader {
+  char Magic[4];
+  uint16_t Version;
+  uint16_t Flags;
+} __attribute__((packed));
+
+// The log of a forked child starts with what the thread calling fork had
+// logged so far. Instead of a copy of it, the child's LogFileHeader has the
+// Forked flag and is followed by a LogParentRef and the name of the parent's
+// log, which is in the same directory. The child's log consists of the first
+// ParentLogSize bytes of the parent's log, and then its own records.
+struct LogParentRef {
+  uint64_t ParentLogSize;
+  uint16_t NameLength;
+} __attribute__((packed));
+
+// Since version 2, the rest of a log after the LogFileHeader (and the
+// LogParentRef) is a sequence of segments. Each segment takes Capacity bytes
+// including its LogSegmentHeader, except that the last one ends where the log
+// ends, so the segments are at fixed strides even if the log is truncated.
+// Records and blocks never span segments; the unused tail of a segment is
+// zero padding. Each segment starts with a fresh LogCodecState, so that it
+// can be decoded on its own.
+struct LogSegmentHeader {
+  char Magic[4];
+  uint16_t Version;
+  // sizeof(void *) of the instrumented program.
+  uint8_t PointerSize;
+  uint8_t Reserved;
+  // The thread that wrote the segment.
+  uint32_t ThreadID;
+  // Identifies the module the program is instrumented from, see
+  // DynAAUtils::GetModuleHash. 0 if unknown.
+  uint64_t ModuleHash;
+  // The number of records in the log before this segment, including those of
+  // the parent's log for a forked child.
+  uint64_t FirstRecordID;
+  uint64_t Capacity;
+} __attribute__((packed));
+
+// A log closed at exit ends with an index of its segments, i.e. a
+// LogSegmentIndexEntry for each segment and then a LogIndexTrailer. A log
+// without the trailer was not closed, e.g. the program crashed.
+struct LogSegmentIndexEntry {
+  uint64_t Offset;
+  uint64_t FirstRecordID;
+} __attribute__((packed));
+
+struct LogIndexTrailer {
+  uint64_t NumSegments;
+  char Magic[4];
+} __attribute__((packed));
+
+// In a compressed log, the segments hold blocks, each of which is a
+// LogBlockHeader followed by the zstd-compressed records. Records never span
+// blocks, and each block starts with a fresh LogCodecState.
+struct LogBlockHeader {
+  uint32_t CompressedSize;
+  uint32_t RawSize;
+} __attribute__((packed));
+
+// The last addresses and IDs seen by a delta-encoded log. The encoder and the
+// decoder of a log must start from the same state and see the same records.
+// It is a POD so that the runtime can keep one in thread-local storage; the
+// initial state is all zeros, e.g. LogCodecState().
+struct LogCodecState {
+  // Fields of different kinds are far apart from each other, e.g. a heap
+  // pointee and the stack slot it is loaded from, so each kind is diffed
+  // against the last field of the same kind.
+  enum AddressKind {
+    // The address a pointer points to, including allocated addresses.
+    PointeeAddress,
+    // The address a pointer is loaded from or stored to.
+    PointerAddress,
+    NumAddressKinds
+  };
+  enum IDKind {
+    PointerValueID,
+    BasicBlockID,
+    InstructionID,
+    FunctionID,
+    NumIDKinds
+  };
+
+  uint64_t LastAddress[NumAddressKinds];
+  uint32_t LastID[NumIDKinds];
+  uint64_t LastStamp;
+};
+
+struct LogFormat {
+  // Version 1 logs have no segments.
+  static const uint16_t CurrentVersion = 2;
+  static const uint16_t FirstSegmentedVersion = 2;
+  // Flags in LogFileHeader.
+  enum {
+    // Addresses and IDs are varints of the zigzagged difference from the
+    // previous address or ID of the same kind in the same thread. Bounds are
+    // plain varints. See LogCodecState.
+    DeltaEncoding = 1,
+    // Records are compressed in blocks. See LogBlockHeader.
+    Compressed = 2,
+    // The log refers to a prefix of its parent's log. See LogParentRef.
+    Forked = 4,
+    // Each record ends with a stamp that orders it among the records of all
+    // threads, either a global counter or the time stamp counter. The stamp
+    // is diffed against the previous one if DeltaEncoding is set, and is a
+    // plain uint64_t otherwise.
+    Stamped = 8
+  };
+  // Traces are repetitive enough that the fastest zstd level does well.
+  static const int CompressionLevel = 1;
+  // Each record is a one-byte tag followed by the fields of the record. The
+  // tag is the record type plus one; tag 0 marks the zero padding left by the
+  // mmap writer. Without DeltaEncoding, the fields are the record of that
+  // type as is, so small records such as EnterRecord take 5 bytes instead of
+  // sizeof(LogRecord).
+  // A record has at most five fields, e.g. FrameSlotRecord, and a stamp.
+  static const size_t MaxVarintSize = 10;
+  static const size_t MaxEncodedSize = 1 + 6 * MaxVarintSize;
+
+  static void InitHeader(LogFileHeader &Header, uint16_t Flags = 0) {
+    memcpy(Header.Magic, "NGLG", 4);
+    Header.Version = CurrentVersion;
+    Header.Flags = Flags;
+  }
+
+  static bool IsValidHeader(const LogFileHeader &Header) {
+    return memcmp(Header.Magic, "NGLG", 4) == 0;
+  }
+
+  static void InitSegmentHeader(LogSegmentHeader &Header, uint32_t ThreadID,
+                                uint64_t ModuleHash, uint64_t FirstRecordID,
+                                uint64_t Capacity) {
+    memcpy(Header.Magic, "NGSG", 4);
+    Header.Version = CurrentVersion;
+    Header.PointerSize = sizeof(void *);
+    Header.Reserved = 0;
+    Header.ThreadID = ThreadID;
+    Header.ModuleHash = ModuleHash;
+    Header.FirstRecordID = FirstRecordID;
+    Header.Capacity = Capacity;
+  }
+
+  static bool IsValidSegmentHeader(const LogSegmentHeader &Header) {
+    return memcmp(Header.Magic, "NGSG", 4) == 0 &&
+        Header.Capacity > sizeof Header;
+  }
+
+  static void InitIndexTrailer(LogIndexTrailer &Trailer,
+                               uint64_t NumSegments) {
+    Trailer.NumSegments = NumSegments;
+    memcpy(Trailer.Magic, "NGIX", 4);
+  }
+
+  static bool IsValidIndexTrailer(const LogIndexTrailer &Trailer) {
+    return memcmp(Trailer.Magic, "NGIX", 4) == 0;
+  }
+
+  // The number of LogRecordTypes. GlobalAlloc is the last one.
+  static const unsigned NumRecordTypes = LogRecord::GlobalAlloc + 1;
+
+  static size_t GetPayloadSize(LogRecord::LogRecordType Type) {
+    switch (Type) {
+      case LogRecord::MemAlloc: return sizeof(MemAllocRecord);
+      case LogRecord::TopLevel: return sizeof(TopLevelRecord);
+      case LogRecord::Enter: return sizeof(EnterRecord);
+      case LogRecord::Store: return sizeof(StoreRecord);
+      case LogRecord::Call: return sizeof(CallRecord);
+      case LogRecord::Return: return sizeof(ReturnRecord);
+      case LogRecord::BasicBlock: return sizeof(BasicBlockRecord);
+      case LogRecord::FrameSlot: return sizeof(FrameSlotRecord);
+      case LogRecord::FrameAlloc: return sizeof(FrameAllocRecord);
+      case LogRecord::MemFree: return sizeof(MemFreeRecord);
+      case LogRecord::GlobalAlloc: return sizeof(GlobalAllocRecord);
+    }
+    return 0;
+  }
+
+  // Encodes <Record> into <Buffer>, which must have at least MaxEncodedSize
+  // bytes. <Stamp> is encoded only if <Flags> has Stamped. Returns the number
+  // of bytes used.
+  static size_t Encode(const LogRecord &Record, uint64_t Stamp, char *Buffer,
+                       uint16_t Flags, LogCodecState &State) {
+    Buffer[0] = (char)(Record.RecordType + 1);
+    if (!(Flags & DeltaEncoding)) {
+      size_t PayloadSize = GetPayloadSize(Record.RecordType);
+      memcpy(Buffer + 1, &Record.MAR, PayloadSize);
+      return EncodeStamp(Buffer + 1 + PayloadSize, Stamp, Flags, State) -
+          Buffer;
+    }
+
+    char *P = Buffer + 1;
+    switch (Record.RecordType) {
+      case LogRecord::MemAlloc:
+        P = EncodeAddress(P, Record.MAR.Address, LogCodecState::PointeeAddress,
+                          State);
+        P = EncodeVarint(P, Record.MAR.Bound);
+        P = EncodeID(P, Record.MAR.AllocatedBy, LogCodecState::InstructionID,
+                     State);
+        break;
+      case LogRecord::TopLevel:
+        P = EncodeID(P, Record.TLR.PointerValueID,
+                     LogCodecState::PointerValueID, State);
+        P = EncodeAddress(P, Record.TLR.PointeeAddress,
+                          LogCodecState::PointeeAddress, State);
+        P = EncodeAddress(P, Record.TLR.LoadedFrom,
+                          LogCodecState::PointerAddress, State);
+        break;
+      case LogRecord::Enter:
+        P = EncodeID(P, Record.ER.FunctionID, LogCodecState::FunctionID, State);
+        break;
+      case LogRecord::Store:
+        P = EncodeAddress(P, Record.SR.PointerAddress,
+                          LogCodecState::PointerAddress, State);
+        P = EncodeAddress(P, Record.SR.PointeeAddress,
+                          LogCodecState::PointeeAddress, State);
+        P = EncodeID(P, Record.SR.InstructionID, LogCodecState::InstructionID,
+                     State);
+        break;
+      case LogRecord::Call:
+        P = EncodeID(P, Record.CR.InstructionID, LogCodecState::InstructionID,
+                     State);
+        break;
+      case LogRecord::Return:
+        P = EncodeID(P, Record.RR.FunctionID, LogCodecState::FunctionID, State);
+        P = EncodeID(P, Record.RR.InstructionID, LogCodecState::InstructionID,
+                     State);
+        break;
+      case LogRecord::BasicBlock:
+        P = EncodeID(P, Record.BBR.ValueID, LogCodecState::BasicBlockID, State);
+        break;
+      case LogRecord::FrameSlot:
+        P = EncodeID(P, Record.FSR.FunctionID, LogCodecState::FunctionID,
+                     State);
+        P = EncodeVarint(P, Record.FSR.Index);
+        P = EncodeVarint(P, Record.FSR.Offset);
+        P = EncodeVarint(P, Record.FSR.Bound);
+        P = EncodeID(P, Record.FSR.AllocatedBy, LogCodecState::InstructionID,
+                     State);
+        break;
+      case LogRecord::FrameAlloc:
+        P = EncodeID(P, Record.FAR.FunctionID, LogCodecState::FunctionID,
+                     State);
+        P = EncodeAddress(P, Record.FAR.Base, LogCodecState::PointeeAddress,
+                          State);
+        break;
+      case LogRecord::MemFree:
+        P = EncodeAddress(P, Record.MFR.Address, LogCodecState::PointeeAddress,
+                          State);
+        break;
+      case LogRecord::GlobalAlloc:
+        P = EncodeAddress(P, Record.GAR.Address, LogCodecState::PointeeAddress,
+                          State);
+        P = EncodeVarint(P, Record.GAR.Bound);
+        P = EncodeID(P, Record.GAR.ValueID, LogCodecState::PointerValueID,
+                     State);
+        break;
+    }
+    P = EncodeStamp(P, Stamp, Flags, State);
+    return P - Buffer;
+  }
+
+  // Decodes one record and its stamp from the <Size> bytes at <Buffer>.
+  // <Stamp> is 0 unless <Flags> has Stamped. Returns the number of bytes
+  // consumed, or 0 if <Buffer> holds padding or a truncated record. <State>
+  // is updated only if a record is decoded.
+  static size_t Decode(const char *Buffer, size_t Size, LogRecord &Record,
+                       uint64_t &Stamp, uint16_t Flags,
+                       LogCodecState &State) {
+    if (Size == 0 || Buffer[0] == 0)
+      return 0;
+    Record.RecordType = (LogRecord::LogRecordType)(Buffer[0] - 1);
+    size_t PayloadSize = GetPayloadSize(Record.RecordType);
+    if (PayloadSize == 0)
+      return 0;
+    if (!(Flags & DeltaEncoding)) {
+      if (1 + PayloadSize > Size)
+        return 0;
+      memcpy(&Record.MAR, Buffer + 1, PayloadSize);
+      const char *P = DecodeStamp(Buffer + 1 + PayloadSize, Buffer + Size,
+                                  Stamp, Flags, State);
+      return P ? P - Buffer : 0;
+    }
+
+    // The fields of a packed record cannot be bound to references, so they
+    // are decoded into these temporaries first.
+    const char *P = Buffer + 1, *End = Buffer + Size;
+    LogCodecState NewState = State;
+    void *A1 = NULL, *A2 = NULL;
+    unsigned ID1 = 0, ID2 = 0;
+    uint64_t Bound = 0, Index = 0, Offset = 0;
+    switch (Record.RecordType) {
+      case LogRecord::MemAlloc:
+        P = DecodeAddress(P, End, A1, LogCodecState::PointeeAddress, NewState);
+        P = DecodeVarint(P, End, Bound);
+        P = DecodeID(P, End, ID1, LogCodecState::InstructionID, NewState);
+        Record.MAR.Address = A1;
+        Record.MAR.Bound = Bound;
+        Record.MAR.AllocatedBy = ID1;
+        break;
+      case LogRecord::TopLevel:
+        P = DecodeID(P, End, ID1, LogCodecState::PointerValueID, NewState);
+        P = DecodeAddress(P, End, A1, LogCodecState::PointeeAddress, NewState);
+        P = DecodeAddress(P, End, A2, LogCodecState::PointerAddress, NewState);
+        Record.TLR.PointerValueID = ID1;
+        Record.TLR.PointeeAddress = A1;
+        Record.TLR.LoadedFrom = A2;
+        break;
+      case LogRecord::Enter:
+        P = DecodeID(P, End, ID1, LogCodecState::FunctionID, NewState);
+        Record.ER.FunctionID = ID1;
+        break;
+      case LogRecord::Store:
+        P = DecodeAddress(P, End, A1, LogCodecState::PointerAddress, NewState);
+        P = DecodeAddress(P, End, A2, LogCodecState::PointeeAddress, NewState);
+        P = DecodeID(P, End, ID1, LogCodecState::InstructionID, NewState);
+        Record.SR.PointerAddress = A1;
+        Record.SR.PointeeAddress = A2;
+        Record.SR.InstructionID = ID1;
+        break;
+      case LogRecord::Call:
+        P = DecodeID(P, End, ID1, LogCodecState::InstructionID, NewState);
+        Record.CR.InstructionID = ID1;
+        break;
+      case LogRecord::Return:
+        P = DecodeID(P, End, ID1, LogCodecState::FunctionID, NewState);
+        P = DecodeID(P, End, ID2, LogCodecState::InstructionID, NewState);
+        Record.RR.FunctionID = ID1;
+        Record.RR.InstructionID = ID2;
+        break;
+      case LogRecord::BasicBlock:
+        P = DecodeID(P, End, ID1, LogCodecState::BasicBlockID, NewState);
+        Record.BBR.ValueID = ID1;
+        break;
+      case LogRecord::FrameSlot:
+        P = DecodeID(P, End, ID1, LogCodecState::FunctionID, NewState);
+        P = DecodeVarint(P, End, Index);
+        P = DecodeVarint(P, End, Offset);
+        P = DecodeVarint(P, End, Bound);
+        P = DecodeID(P, End, ID2, LogCodecState::InstructionID, NewState);
+        Record.FSR.FunctionID = ID1;
+        Record.FSR.Index = Index;
+        Record.FSR.Offset = Offset;
+        Record.FSR.Bound = Bound;
+        Record.FSR.AllocatedBy = ID2;
+        break;
+      case LogRecord::FrameAlloc:
+        P = DecodeID(P, End, ID1, LogCodecState::FunctionID, NewState);
+        P = DecodeAddress(P, End, A1, LogCodecState::PointeeAddress, NewState);
+        Record.FAR.FunctionID = ID1;
+        Record.FAR.Base = A1;
+        break;
+      case LogRecord::MemFree:
+        P = DecodeAddress(P, End, A1, LogCodecState::PointeeAddress, NewState);
+        Record.MFR.Address = A1;
+        break;
+      case LogRecord::GlobalAlloc:
+        P = DecodeAddress(P, End, A1, LogCodecState::PointeeAddress, NewState);
+        P = DecodeVarint(P, End, Bound);
+        P = DecodeID(P, End, ID1, LogCodecState::PointerValueID, NewState);
+        Record.GAR.Address = A1;
+        Record.GAR.Bound = Bound;
+        Record.GAR.ValueID = ID1;
+        break;
+    }
+    P = DecodeStamp(P, End, Stamp, Flags, NewState);
+    if (!P)
+      return 0;
+    State = NewState;
+    return P - Buffer;
+  }
+
+ private:
+  static char *EncodeVarint(char *P, uint64_t V) {
+    while (V >= 0x80) {
+      *P++ = (char)(V | 0x80);
+      V >>= 7;
+    }
+    *P++ = (char)V;
+    return P;
+  }
+
+  // Returns NULL if the varint is truncated or <P> is already NULL, so that
+  // the decoders can be chained without checking each step.
+  static const char *DecodeVarint(const char *P, const char *End,
+                                  uint64_t &V) {
+    if (!P)
+      return NULL;
+    V = 0;
+    for (unsigned Shift = 0; P < End && Shift < 64; Shift += 7) {
+      uint8_t Byte = (uint8_t)*P++;
+      V |= (uint64_t)(Byte & 0x7f) << Shift;
+      if (!(Byte & 0x80))
+        return P;
+    }
+    return NULL;
+  }
+
+  // Zigzag encoding maps small negative differences to small varints.
+  static uint64_t ZigZag(uint64_t Delta) {
+    return (Delta << 1) ^ (uint64_t)((int64_t)Delta >> 63);
+  }
+
+  static uint64_t UnZigZag(uint64_t V) {
+    return (V >> 1) ^ -(V & 1);
+  }
+
+  // Address varints are offset by one, so that NULL, which is common in
+  // LoadedFrom, takes a single zero byte and leaves the state untouched.
+  static char *EncodeAddress(char *P, void *Address, unsigned Kind,
+                             LogCodecState &State) {
+    uint64_t A = (uintptr_t)Address;
+    if (A == 0)
+      return EncodeVarint(P, 0);
+    P = EncodeVarint(P, ZigZag(A - State.LastAddress[Kind]) + 1);
+    State.LastAddress[Kind] = A;
+    return P;
+  }
+
+  static char *EncodeID(char *P, unsigned ID, unsigned Kind,
+                        LogCodecState &State) {
+    // Sign-extend the 32-bit difference so that a small step back is small.
+    int64_t Delta = (int32_t)(ID - State.LastID[Kind]);
+    P = EncodeVarint(P, ZigZag((uint64_t)Delta));
+    State.LastID[Kind] = ID;
+    return P;
+  }
+
+  static const char *DecodeAddress(const char *P, const char *End,
+                                   void *&Address, unsigned Kind,
+                                   LogCodecState &State) {
+    uint64_t V;
+    P = DecodeVarint(P, End, V);
+    if (P) {
+      if (V == 0) {
+        Address = NULL;
+      } else {
+        State.LastAddress[Kind] += UnZigZag(V - 1);
+        Address = (void *)(uintptr_t)State.LastAddress[Kind];
+      }
+    }
+    return P;
+  }
+
+  static char *EncodeStamp(char *P, uint64_t Stamp, uint16_t Flags,
+                           LogCodecState &State) {
+    if (!(Flags & Stamped))
+      return P;
+    if (!(Flags & DeltaEncoding)) {
+      memcpy(P, &Stamp, sizeof Stamp);
+      return P + sizeof Stamp;
+    }
+    P = EncodeVarint(P, ZigZag(Stamp - State.LastStamp));
+    State.LastStamp = Stamp;
+    return P;
+  }
+
+  static const char *DecodeStamp(const char *P, const char *End,
+                                 uint64_t &Stamp, uint16_t Flags,
+                                 LogCodecState &State) {
+    Stamp = 0;
+    if (!P || !(Flags & Stamped))
+      return P;
+    if (!(Flags & DeltaEncoding)) {
+      if (P + sizeof Stamp > End)
+        return NULL;
+      memcpy(&Stamp, P, sizeof Stamp);
+      return P + sizeof Stamp;
+    }
+    uint64_t V;
+    P = DecodeVarint(P, End, V);
+    if (P) {
+      State.LastStamp += UnZigZag(V);
+      Stamp = State.LastStamp;
+    }
+    return P;
+  }
+
+  static const char *DecodeID(const char *P, const char *End, unsigned &ID,
+                              unsigned Kind, LogCodecState &State) {
+    uint64_t V;
+    P = DecodeVarint(P, End, V);
+    if (P) {
+      State.LastID[Kind] += (uint32_t)UnZigZag(V);
+      ID = State.LastID[Kind];
+    }
+    return P;
+  }
+};
+}
+
+#endif
@@ -3,16 +3,54 @@
 
 #include <pthread.h>
 
+#include <stdint.h>
+
+#include <sys/types.h>
+
 #include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
 
 #include "dyn-aa/LogRecord.h"
 
 namespace neongoby {
+struct LogSegmentHeader;
+
+// The records of a versioned log file between offsets Begin and End.
+struct LogRange {
+  FILE *File;
+  uint16_t Flags;
+  off_t Begin, End;
+  // Set if the range is a segment, which starts with a fresh LogCodecState
+  // and can be decoded on its own. The ranges of a log before version 2 are
+  // not segments.
+  bool IsSegment;
+  // The ID of the first record in the range, i.e. the number of records
+  // before it in the log.
+  uint64_t FirstRecordID;
+};
+
 struct LogProcessor {
-  LogProcessor(): CurrentRecordID(0) {}
+  LogProcessor(): CurrentRecordID(0), CurrentLogID(0), ReversedOrder(false),
+                  ModuleHash(0), StartRecordID(0) {}
 
   void processLog(bool Reversed = false);
+  // Makes processLog reject logs of programs instrumented from a different
+  // module, see DynAAUtils::GetModuleHash. 0 accepts any log.
+  void setModuleHash(uint64_t Hash) { ModuleHash = Hash; }
+  // Makes processLog process each log forward from the record with ID <ID>,
+  // skipping the segments before it without decoding them. The skipped
+  // allocations, entries and returns are not dispatched, and
+  // getCurrentRecordID still counts from 0, so only processors that look at
+  // each record on its own, e.g. LogDumper, should skip.
+  void setStartRecord(uint64_t ID) { StartRecordID = ID; }
   unsigned getCurrentRecordID() const { return CurrentRecordID; }
+  // Returns the index of the log file the current record comes from. With
+  // -merge-logs, records of different log files, i.e. different threads,
+  // interleave, so per-thread state such as call stacks should be keyed by
+  // this index.
+  unsigned getCurrentLogID() const { return CurrentLogID; }
 
   // initialize is called before processing each log file, and finalize is
   // called after processing each log file.
@@ -43,13 +81,92 @@ struct LogProcessor {
   virtual void processCall(const CallRecord &) {}
   virtual void processReturn(const ReturnRecord &) {}
   virtual void processBasicBlock(const BasicBlockRecord &) {}
+  // Called for each MemFreeRecord, and, when processing forward, for each slot
+  // of a frame when the function returns.
+  virtual void processMemFree(const MemFreeRecord &) {}
+  // Called when processing records streamed with -log-shm catches up with
+  // the instrumented program, e.g. to publish results incrementally.
+  virtual void afterCatchingUp() {}
 
  private:
   void processLog(const std::string &LogFileName, bool Reversed);
+  // Processes the records of all log files in the order of their stamps.
+  void processMergedLogs();
+  // Processes the records streamed through -log-shm as they arrive, until
+  // the instrumented program exits.
+  void processStream();
+  // Logs written before LogFileHeader was introduced.
+  void processLegacyLog(FILE *LogFile, bool Reversed);
+  // Appends to <Ranges> the ranges of the log <LogFileName> up to offset <End>,
+  // preceded by the ranges of its parents' logs if it was written by a forked
+  // child.
+  void openLogRanges(const std::string &LogFileName, off_t End,
+                     std::vector<LogRange> &Ranges);
+  // Appends the segments of <LogFile> between offsets <Begin> and <End>.
+  void openLogSegments(const std::string &LogFileName, FILE *LogFile,
+                       uint16_t Flags, off_t Begin, off_t End,
+                       std::vector<LogRange> &Ranges);
+  // Checks that the segment of <LogName> comes from the analyzed module.
+  void checkSegmentHeader(const std::string &LogName,
+                          const LogSegmentHeader &Header) const;
+  static void CloseLogRanges(const std::vector<LogRange> &Ranges);
+  void processReversedLog(const std::vector<LogRange> &Ranges);
+  void processReversedCompressedLog(const std::vector<LogRange> &Ranges);
+  // Warns if some bytes of the log are not processed.
+  void checkNumBytesRead();
+  // Dispatches <Record> to the callbacks, expanding frame records. <Size> is
+  // the number of bytes the record takes in the log.
+  void processRecord(const LogRecord &Record, size_t Size);
+  void addFrameSlot(const FrameSlotRecord &Slot);
+  // Dispatches a MemAllocRecord for each slot of the frame.
+  void expandFrameAlloc(const FrameAllocRecord &Frame);
+  // Dispatches a MemAllocRecord and a TopLevelRecord for the global.
+  void expandGlobalAlloc(const GlobalAllocRecord &Global);
+  // Dispatches <Base>, and a TopLevelRecord for each pointer derived from it.
+  void expandTopLevel(const LogRecord &Base);
+  // Reads the file given by -derivations into DerivedPointers.
+  void loadDerivations();
+  void dispatchRecord(const LogRecord &Record);
+  // Releases the frames of the invocations that return with a ReturnRecord of
+  // <FunctionID>.
+  void releaseFrames(unsigned FunctionID);
   static bool ReadData(void *P, int Length, bool Reversed, FILE *LogFile);
+  static bool IsPadding(const LogRecord &Record);
   static off_t GetFileSize(FILE *LogFile);
 
   unsigned CurrentRecordID;
+  unsigned CurrentLogID;
+  // Set while records are processed from the last to the first.
+  bool ReversedOrder;
+  uint64_t ModuleHash;
+  uint64_t StartRecordID;
+  // The slots of each function's frame, indexed by the function ID. Layouts
+  // are fixed at instrumentation time, so they are shared by all logs.
+  std::map<unsigned, std::vector<FrameSlotRecord> > FrameLayouts;
+  // An invocation on a call stack and its frame base, NULL if it has no
+  // frame.
+  struct ActiveFrame {
+    unsigned FunctionID;
+    void *Base;
+  };
+  // A pointer whose hook MemoryInstrumenter elided because its value is its
+  // base's plus Offset.
+  struct DerivedPointer {
+    bool operator<(const DerivedPointer &Other) const {
+      return ValueID < Other.ValueID;
+    }
+
+    unsigned ValueID;
+    int64_t Offset;
+  };
+  // The pointers derived from each base, indexed by the base's value ID, in
+  // the order they are computed.
+  std::map<unsigned, std::vector<DerivedPointer> > DerivedPointers;
+  // The call stack of each log, indexed by the log ID. Maintained only when
+  // processing forward.
+  std::map<unsigned, std::vector<ActiveFrame> > CallStacks;
+  // Used for printing the progress bar.
+  uint64_t FileSize, NumBytesRead;
 };
 }
 
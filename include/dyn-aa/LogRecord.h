@@ -46,7 +46,41 @@ struct BasicBlockRecord {
   unsigned ValueID;
 } __attribute__((packed));
 
+// The allocas in the entry block of a function are coalesced into one frame.
+// Each FrameSlotRecord describes the slot allocated by <AllocatedBy>, i.e.
+// [frame base + Offset, frame base + Offset + Bound). A log has the slots of a
+// function, Index 0 first, before the function's first FrameAllocRecord.
+struct FrameSlotRecord {
+  unsigned FunctionID;
+  unsigned Index;
+  unsigned Offset;
+  unsigned Bound;
+  unsigned AllocatedBy;
+} __attribute__((packed));
+
+// Allocates all slots of the frame of an invocation of <FunctionID>.
+// LogProcessor expands it into a MemAllocRecord per slot.
+struct FrameAllocRecord {
+  unsigned FunctionID;
+  void *Base;
+} __attribute__((packed));
+
+// Logged before free, delete and delete[] release the block at <Address>.
+struct MemFreeRecord {
+  void *Address;
+} __attribute__((packed));
+
+// Allocates the global variable or function <ValueID>, i.e. [Address,
+// Address + Bound), and defines pointer <ValueID> as Address. LogProcessor
+// expands it into a MemAllocRecord and a TopLevelRecord.
+struct GlobalAllocRecord {
+  void *Address;
+  unsigned long Bound;
+  unsigned ValueID;
+} __attribute__((packed));
+
 struct LogRecord {
+  // New types go last, so that legacy logs keep their meaning.
   enum LogRecordType {
     MemAlloc,
     TopLevel,
@@ -54,7 +88,11 @@ struct LogRecord {
     Store,
     Call,
     Return,
-    BasicBlock
+    BasicBlock,
+    FrameSlot,
+    FrameAlloc,
+    MemFree,
+    GlobalAlloc
   } __attribute__((packed));
 
   LogRecordType RecordType;
@@ -66,6 +104,10 @@ struct LogRecord {
     CallRecord CR;
     ReturnRecord RR;
     BasicBlockRecord BBR;
+    FrameSlotRecord FSR;
+    FrameAllocRecord FAR;
+    MemFreeRecord MFR;
+    GlobalAllocRecord GAR;
   };
 };
 } // namespace neongoby
@@ -0,0 +1,105 @@
+// The shared memory through which the instrumented program streams its
+// records to an analyzer process (LOG_WRITER=shm) instead of writing log
+// files. Shared by the runtime, which produces the streams, and LogProcessor,
+// which consumes them with -log-shm.
+
+#ifndef __DYN_AA_LOG_STREAM_H
+#define __DYN_AA_LOG_STREAM_H
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <cstring>
+
+namespace neongoby {
+// The analyzer creates the shared memory object and lays it out as a
+// LogStreamArea, NumSlots LogStreamSlots, and then the ring of each slot.
+// Each thread of the instrumented program claims a slot and streams what
+// would be its log file: a LogFileHeader, a LogSegmentHeader whose segment
+// never fills up, and the records. Streams are never compressed, and the
+// program must not fork.
+struct LogStreamArea {
+  char Magic[4];
+  uint16_t Version;
+  uint16_t Reserved;
+  uint32_t NumSlots;
+  uint32_t Reserved2;
+  // The capacity of each ring, a power of two.
+  uint64_t RingCapacity;
+  // The number of slots claimed so far, which may exceed NumSlots if the
+  // program runs out of them.
+  volatile uint32_t NumClaimedSlots;
+  // The processes that are streaming, i.e. 1 until the program exits. A
+  // process that dies without exiting normally is never subtracted.
+  volatile int32_t NumProducers;
+};
+
+// A single-producer single-consumer ring, like the rings of LOG_WRITER=ring.
+// Head and Tail grow monotonically and are masked into offsets.
+struct LogStreamSlot {
+  enum {
+    Free = 0,
+    // The producer is appending to the ring.
+    Open,
+    // The producer has appended everything.
+    Closed
+  };
+
+  volatile uint32_t State;
+  // The process and the thread owning the slot.
+  uint32_t ProcessID;
+  uint32_t ThreadID;
+  uint32_t Reserved;
+  // Only the producer writes Head.
+  volatile uint64_t Head;
+  // Only the analyzer writes Tail. Kept in another cache line than Head.
+  char Padding[40];
+  volatile uint64_t Tail;
+  char Padding2[56];
+};
+
+struct LogStream {
+  static const uint16_t CurrentVersion = 1;
+
+  static size_t GetAreaSize(uint32_t NumSlots, uint64_t RingCapacity) {
+    return GetRingOffset(NumSlots, RingCapacity, NumSlots);
+  }
+
+  // Initializes a zero-filled area.
+  static void InitArea(LogStreamArea *Area, uint32_t NumSlots,
+                       uint64_t RingCapacity) {
+    memcpy(Area->Magic, "NGSM", 4);
+    Area->Version = CurrentVersion;
+    Area->NumSlots = NumSlots;
+    Area->RingCapacity = RingCapacity;
+  }
+
+  static bool IsValidArea(const LogStreamArea *Area) {
+    return memcmp(Area->Magic, "NGSM", 4) == 0 &&
+        Area->Version == CurrentVersion && Area->NumSlots > 0 &&
+        Area->RingCapacity > 0 &&
+        (Area->RingCapacity & (Area->RingCapacity - 1)) == 0;
+  }
+
+  static LogStreamSlot *GetSlot(LogStreamArea *Area, uint32_t Index) {
+    return (LogStreamSlot *)((char *)Area + sizeof(LogStreamArea)) + Index;
+  }
+
+  static char *GetRing(LogStreamArea *Area, uint32_t Index) {
+    return (char *)Area +
+        GetRingOffset(Area->NumSlots, Area->RingCapacity, Index);
+  }
+
+ private:
+  static size_t GetRingOffset(uint32_t NumSlots, uint64_t RingCapacity,
+                              uint32_t Index) {
+    // Rings start at a page boundary.
+    size_t RingsOffset = sizeof(LogStreamArea) +
+        NumSlots * sizeof(LogStreamSlot);
+    RingsOffset = (RingsOffset + 4095) / 4096 * 4096;
+    return RingsOffset + Index * RingCapacity;
+  }
+};
+}
+
+#endif
@@ -7,6 +7,10 @@
 #include "llvm/Value.h"
 #include "llvm/Pass.h"
 
+namespace rcs {
+struct IDAssigner;
+}
+
 namespace neongoby {
 struct DynAAUtils {
   static const std::string MemAllocHookName;
@@ -17,11 +21,17 @@ struct DynAAUtils {
   static const std::string CallHookName;
   static const std::string ReturnHookName;
   static const std::string GlobalsAllocHookName;
+  static const std::string GlobalsAllocTableHookName;
   static const std::string BasicBlockHookName;
   static const std::string MemHooksIniterName;
   static const std::string AfterForkHookName;
   static const std::string BeforeForkHookName;
   static const std::string VAStartHookName;
+  static const std::string FrameAllocHookName;
+  static const std::string MemFreeHookName;
+  static const std::string TopLevelBatchHookName;
+  static const std::string TopLevelValueHookName;
+  static const std::string TopLevelBatchNonNullHookName;
   static const std::string SlotsName;
 
   static void PrintProgressBar(uint64_t Old, uint64_t Now, uint64_t Total);
@@ -29,10 +39,15 @@ struct DynAAUtils {
   static void PrintValue(llvm::raw_ostream &O, const llvm::Value *V);
   static bool IsMalloc(const llvm::Function *F);
   static bool IsMallocCall(const llvm::Value *V);
+  static bool IsFree(const llvm::Function *F);
   static bool IsIntraProcQuery(const llvm::Value *V1, const llvm::Value *V2);
   static bool IsReallyIntraProcQuery(const llvm::Value *V1,
                                      const llvm::Value *V2);
   static const llvm::Function *GetContainingFunction(const llvm::Value *V);
+  // Identifies the IDs IDAssigner gives to the values of <M>. Logs carry the
+  // hash of the module the program is instrumented from, so that they are
+  // not processed with a different module. Never 0.
+  static uint64_t GetModuleHash(const llvm::Module &M, rcs::IDAssigner &IDA);
 };
 }
 
@@ -47,18 +47,20 @@ bool DynamicAliasAnalysis::runOnModule(Module &M) {
 
   IDAssigner &IDA = getAnalysis<IDAssigner>();
 
-  processLog();
-
-  errs() << "# of aliases = " << Aliases.size() << "\n";
+  // Write the aliases as they are found, so that they can be watched while
+  // processing the records streamed from a running program.
   if (OutputDynamicAliases != "") {
     string ErrorInfo;
-    raw_fd_ostream OutputFile(OutputDynamicAliases.c_str(), ErrorInfo);
-    for (auto &Alias : Aliases) {
-      Value *V1 = Alias.first, *V2 = Alias.second;
-      OutputFile << IDA.getValueID(V1) << " " << IDA.getValueID(V2) << "\n";
-    }
+    AliasOutput = new raw_fd_ostream(OutputDynamicAliases.c_str(), ErrorInfo);
   }
 
+  setModuleHash(DynAAUtils::GetModuleHash(M, IDA));
+  processLog();
+
+  errs() << "# of aliases = " << Aliases.size() << "\n";
+  delete AliasOutput;
+  AliasOutput = NULL;
+
 #if 0
   errs() << PointersVersionUnknown.size()
       << " pointers whose version is unknown:\n";
@@ -93,11 +95,10 @@ void DynamicAliasAnalysis::initialize() {
   CurrentVersion = 0;
   PointedBy.clear();
   PointsTo.clear();
+  AddressesOfVersion.clear();
   // Do not clear Aliases, PointersVersionUnknown, and AddressVersionUnknown.
   NumInvocations = 0;
-  // std::stack doesn't have clear().
-  while (!CallStack.empty())
-    CallStack.pop();
+  CallStacks.clear();
   ActivePointers.clear();
   OutdatedContexts.clear();
 }
@@ -109,6 +110,32 @@ void DynamicAliasAnalysis::processMemAlloc(const MemAllocRecord &Record) {
   assert(CurrentVersion != UnknownVersion);
 }
 
+void DynamicAliasAnalysis::processMemFree(const MemFreeRecord &Record) {
+  Interval I((unsigned long)Record.Address, (unsigned long)Record.Address + 1);
+  auto Pos = AddressVersion.find(I);
+  if (Pos == AddressVersion.end())
+    return;
+  unsigned Version = Pos->second;
+  AddressVersion.erase(Pos);
+
+  // No pointer can point to this version any more, so the pointers to it
+  // can never alias with later pointers. Dangling pointers to the block now
+  // point to an unknown version.
+  auto J = AddressesOfVersion.find(Version);
+  if (J == AddressesOfVersion.end())
+    return;
+  for (auto &Address : J->second) {
+    auto K = PointedBy.find(Location(Address, Version));
+    assert(K != PointedBy.end());
+    for (auto &Ptr : K->second) {
+      ++NumRemoveOps;
+      PointsTo.erase(Ptr);
+    }
+    PointedBy.erase(K);
+  }
+  AddressesOfVersion.erase(J);
+}
+
 void DynamicAliasAnalysis::processEnter(const EnterRecord &Record) {
   auto I = OutdatedContexts.find(Record.FunctionID);
   if (I != OutdatedContexts.end()) {
@@ -117,10 +144,11 @@ void DynamicAliasAnalysis::processEnter(const EnterRecord &Record) {
     OutdatedContexts.erase(I);
   }
   ++NumInvocations;
-  CallStack.push(NumInvocations);
+  CallStacks[getCurrentLogID()].push(NumInvocations);
 }
 
 void DynamicAliasAnalysis::processReturn(const ReturnRecord &Record) {
+  std::stack<unsigned> &CallStack = CallStacks[getCurrentLogID()];
   assert(!CallStack.empty());
   OutdatedContexts[Record.FunctionID].insert(CallStack.top());
   CallStack.pop();
@@ -148,6 +176,7 @@ void DynamicAliasAnalysis::processTopLevel(const TopLevelRecord &Record) {
     }
 
     // Global variables are processed before any invocation.
+    std::stack<unsigned> &CallStack = CallStacks[getCurrentLogID()];
     Definition Ptr(PointerVID, CallStack.empty() ? 0 : CallStack.top());
     Location Loc(PointeeAddress, Version);
     addPointsTo(Ptr, Loc);
@@ -170,6 +199,13 @@ void DynamicAliasAnalysis::removePointedBy(Definition Ptr, Location Loc) {
   // Do not keep those Location entry which does not map to any Defintion set.
   if (0 == J->second.size()) {
     PointedBy.erase(J);
+    if (Loc.second != UnknownVersion) {
+      auto K = AddressesOfVersion.find(Loc.second);
+      assert(K != AddressesOfVersion.end());
+      K->second.erase(Loc.first);
+      if (K->second.empty())
+        AddressesOfVersion.erase(K);
+    }
   }
 }
 
@@ -196,6 +232,8 @@ void DynamicAliasAnalysis::addPointsTo(Definition Ptr, Location Loc) {
   removePointsTo(Ptr);
   PointsTo[Ptr] = Loc;
   PointedBy[Loc].insert(Ptr);
+  if (Loc.second != UnknownVersion)
+    AddressesOfVersion[Loc.second].insert(Loc.first);
   ActivePointers[Ptr.second].push_back(Ptr.first);
 }
 
@@ -229,7 +267,15 @@ void DynamicAliasAnalysis::addAliasPair(Value *V1, Value *V2) {
   assert(V1 && V2);
   if (V1 > V2)
     swap(V1, V2);
-  Aliases.insert(make_pair(V1, V2));
+  if (Aliases.insert(make_pair(V1, V2)).second && AliasOutput) {
+    IDAssigner &IDA = getAnalysis<IDAssigner>();
+    *AliasOutput << IDA.getValueID(V1) << " " << IDA.getValueID(V2) << "\n";
+  }
+}
+
+void DynamicAliasAnalysis::afterCatchingUp() {
+  if (AliasOutput)
+    AliasOutput->flush();
 }
 
 void DynamicAliasAnalysis::addAliasPair(Definition P, Definition Q) {
@@ -7,7 +7,10 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/ADT/Statistic.h"
 
+#include "rcs/IDAssigner.h"
+
 #include "dyn-aa/DynamicPointerAnalysis.h"
+#include "dyn-aa/Utils.h"
 
 using namespace std;
 using namespace llvm;
@@ -24,6 +27,7 @@ static RegisterAnalysisGroup<PointerAnalysis> Y(X);
 char DynamicPointerAnalysis::ID = 0;
 
 bool DynamicPointerAnalysis::runOnModule(Module &M) {
+  setModuleHash(DynAAUtils::GetModuleHash(M, getAnalysis<IDAssigner>()));
   processLog();
   return false;
 }
@@ -51,6 +55,15 @@ void DynamicPointerAnalysis::processMemAlloc(const MemAllocRecord &Record) {
   MemAllocs.insert(make_pair(I, Allocator));
 }
 
+void DynamicPointerAnalysis::processMemFree(const MemFreeRecord &Record) {
+  // Pointers to the freed block are no longer attributed to its allocator.
+  unsigned long Start = (unsigned long)Record.Address;
+  IntervalTree<Value *>::iterator Pos = MemAllocs.find(Interval(Start,
+                                                                Start + 1));
+  if (Pos != MemAllocs.end())
+    MemAllocs.erase(Pos);
+}
+
 void DynamicPointerAnalysis::processTopLevel(const TopLevelRecord &Record) {
   IDAssigner &IDA = getAnalysis<IDAssigner>();
 
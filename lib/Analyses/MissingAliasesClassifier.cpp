@@ -41,6 +41,7 @@ char MissingAliasesClassifier::ID = 0;
 
 bool MissingAliasesClassifier::runOnModule(Module &M) {
   errs() << "Backward processing...\n";
+  setModuleHash(DynAAUtils::GetModuleHash(M, getAnalysis<IDAssigner>()));
   processLog(true);
 
   return false;
@@ -75,16 +75,21 @@ bool TraceSlicer::runOnModule(Module &M) {
          "we need two starting-record");
   assert((StartingValueIDs.empty() || StartingValueIDs.size() == 2) &&
          "we need two starting-value");
+  uint64_t ModuleHash = DynAAUtils::GetModuleHash(M,
+                                                  getAnalysis<IDAssigner>());
+  setModuleHash(ModuleHash);
   if (StartingRecordIDs.empty()) {
     // The user specifies staring-value instead of starting-record. Need look
     // for starting-record in the trace.
     errs() << "Finding records of the two input values...\n";
     RecordFinder RF;
+    RF.setModuleHash(ModuleHash);
     RF.processLog();
     CurrentRecordID = RF.getCurrentRecordID();
   } else {
     errs() << "Counting log records...\n";
     LogCounter LC;
+    LC.setModuleHash(ModuleHash);
     LC.processLog();
     CurrentRecordID = LC.getNumLogRecords();
   }
@@ -2,17 +2,24 @@
 
 #define DEBUG_TYPE "dyn-aa"
 
+#include <climits>
+#include <cstdio>
 #include <string>
 
 #include "llvm/Module.h"
 #include "llvm/Pass.h"
 #include "llvm/DerivedTypes.h"
 #include "llvm/Constants.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/CaptureTracking.h"
+#include "llvm/Analysis/Dominators.h"
+#include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Support/CallSite.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Target/TargetData.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/DenseSet.h"
 #include "llvm/Transforms/Utils/BuildLibCalls.h"
 #include "llvm/IntrinsicInst.h"
@@ -20,6 +27,7 @@
 #include "rcs/typedefs.h"
 #include "rcs/IDAssigner.h"
 
+#include "dyn-aa/BaselineAliasAnalysis.h"
 #include "dyn-aa/Passes.h"
 #include "dyn-aa/Utils.h"
 
@@ -28,6 +36,33 @@ using namespace std;
 using namespace rcs;
 
 namespace neongoby {
+// Which records the instrumented program logs, chosen by the analyses that
+// will read the log.
+enum InstrumentationProfile {
+  // Everything but the records only diagnosis needs.
+  FullProfile,
+  // No Store records and no LoadedFrom, which only diagnosis reads.
+  CheckAAProfile,
+  // Like CheckAAProfile, and only the pointers that are called.
+  CheckCGProfile,
+  // Everything, the same as -diagnose.
+  DiagnoseProfile
+};
+
+// Which non-escaping allocas -elide-local-allocas leaves unlogged, by how
+// the pointers into them are derived.
+enum LocalAllocaPolicy {
+  // None.
+  NoLocalAllocas,
+  // Those only loaded from and stored to directly.
+  DirectLocalAllocas,
+  // Also those whose pointers are bitcasts and GEPs with constant indices.
+  ConstantOffsetLocalAllocas,
+  // Also those whose pointers are GEPs with variable indices, PHINodes and
+  // selects.
+  AllLocalAllocas
+};
+
 struct MemoryInstrumenter: public ModulePass {
   static char ID;
 
@@ -48,7 +83,12 @@ struct MemoryInstrumenter: public ModulePass {
                                   Instruction *Loc);
   void instrumentFork(const CallSite &CS);
   void instrumentMalloc(const CallSite &CS);
+  void instrumentFree(const CallSite &CS);
   void instrumentAlloca(AllocaInst *AI);
+  // Coalesces FrameAllocas into one frame, and logs the frame with a single
+  // HookFrameAlloc.
+  void instrumentFrame(Function &F);
+  bool isCoalescible(AllocaInst *AI);
   void instrumentStoreInst(StoreInst *SI);
   void instrumentReturnInst(Instruction *I);
   void instrumentCallSite(CallSite CS);
@@ -57,6 +97,42 @@ struct MemoryInstrumenter: public ModulePass {
                          Instruction *DefLoc);
   void instrumentPointerInstruction(Instruction *I);
   void instrumentPointerParameters(Function *F);
+  // Whether instrumentPointer would hook <V> in the absence of derivations.
+  bool needsHook(Value *V);
+  // Whether the analyses of -profile read the TopLevel records of <V>, and,
+  // with -drop-ignored-records, may report <V>.
+  static bool IsReadByProfile(Value *V);
+  // Reads the alias checks of -hook-alias-checks into CheckedPointers.
+  void readAliasChecks();
+  // Finds the pointers of <F> whose values can be derived from the logged
+  // value of another pointer, see Derivations.
+  void findDerivedPointers(Function &F);
+  void writeDerivations(Module &M);
+  // Finds the allocas of <F> that don't escape and the pointers into them,
+  // see LocalPointers.
+  void findLocalPointers(Function &F);
+  // Adds to <Pointers> the pointers derived from <AI>. Returns false if one
+  // is derived in a way -elide-local-allocas doesn't allow, may point
+  // elsewhere as well, or is passed to a function, see IsLocalCallUse.
+  bool collectLocalPointers(AllocaInst *AI, DenseSet<Value *> &Pointers);
+  // Finds the pointers of <F> that have the same value throughout a loop,
+  // see InvariantPointers.
+  void findInvariantPointers(Function &F);
+  bool isInvariantInLoop(Instruction *I, Loop *L, DominatorTree &DT);
+  // Whether <L> contains no calls or allocas, i.e. nothing that logs
+  // allocations, enters or leaves functions, or modifies memory unseen.
+  bool isCallFree(Loop *L);
+  // Replaces each run of TopLevelHook and TopLevelValueHook calls in a basic
+  // block of <F> with one TopLevelBatchHook call at the first call, alloca or
+  // terminator after it.
+  void batchTopLevelHooks(Function &F);
+  // Stores the pointers <Hooks> would log into <Batch>, and logs them with
+  // one TopLevelBatchHook call before <Loc>.
+  void emitTopLevelBatch(const vector<CallInst *> &Hooks, AllocaInst *Batch,
+                         Instruction *Loc);
+  // Makes each TopLevelHook and TopLevelValueHook call of <F> skipped if the
+  // pointer is NULL.
+  void guardTopLevelHooks(Function &F);
   void instrumentGlobals(Module &M);
   void instrumentMainArgs(Module &M);
   void instrumentVarArgFunction(Function *F);
@@ -74,16 +150,52 @@ struct MemoryInstrumenter: public ModulePass {
   Function *MainArgsAllocHook;
   Function *CallHook, *ReturnHook;
   Function *GlobalsAllocHook;
+  // Allocates and hooks the globals in a table.
+  Function *GlobalsAllocTableHook;
   Function *BasicBlockHook;
   Function *MemHooksIniter;
   Function *AfterForkHook, *BeforeForkHook;
   Function *VAStartHook;
+  Function *FrameAllocHook;
+  Function *MemFreeHook;
+  Function *TopLevelBatchHook;
+  // TopLevelHook without LoadedFrom.
+  Function *TopLevelValueHook;
+  // TopLevelBatchHook that skips NULL pointers.
+  Function *TopLevelBatchNonNullHook;
+  // The allocas of the current function's frame.
+  vector<AllocaInst *> FrameAllocas;
+  // Replaced by slots of frames. Erased at the end, because IDAssigner still
+  // refers to them.
+  vector<AllocaInst *> CoalescedAllocas;
+  // With -elide-derived-pointers, the pointers whose hooks are elided, mapped
+  // to the logged pointer and the constant byte offset they are derived from.
+  // The log processors synthesize their TopLevel records from the base's.
+  DenseMap<Value *, pair<Value *, int64_t> > Derivations;
+  // With -hoist-invariant-hooks, the pointers that have the same value in
+  // every iteration of a loop and are computed in the first, mapped to the
+  // terminator of the loop's preheader. They are recomputed and hooked there
+  // instead of in the loop.
+  DenseMap<Instruction *, Instruction *> InvariantPointers;
+  // With -elide-local-allocas, the allocas that don't escape their
+  // functions, and the pointers derived from them. Nothing outside the
+  // function can point to these allocas, so the checked AA decides their
+  // aliases intra-procedurally, and they are neither allocated nor hooked.
+  DenseSet<Value *> LocalPointers;
+  // With -hook-alias-checks, the only pointers to hook.
+  DenseSet<Value *> CheckedPointers;
+  // Whether each loop of the current function is call-free.
+  DenseMap<Loop *, bool> CallFreeLoops;
   // the main function
   Function *Main;
   // types
   IntegerType *CharType, *LongType, *IntType;
   PointerType *CharStarType;
   Type *VoidType;
+  // {AllocatedBy, Offset, Bound}, the FrameSlotLayout of the runtime.
+  StructType *FrameSlotLayoutType;
+  // {ValueID, Hooked, Address, Bound}, the GlobalAllocEntry of the runtime.
+  StructType *GlobalAllocEntryType;
 };
 }
 
@@ -100,6 +212,70 @@ static cl::opt<bool> HookAllPointers("hook-all-pointers",
 static cl::opt<bool> Diagnose("diagnose",
                               cl::desc("Instrument for test case reduction and "
                                        "trace slicing"));
+static cl::opt<InstrumentationProfile> Profile(
+    "profile",
+    cl::desc("Choose the analyses the log is for"),
+    cl::values(
+        clEnumValN(FullProfile, "full", "all but diagnosis"),
+        clEnumValN(CheckAAProfile, "check-aa",
+                   "checking alias analyses (-check-aa)"),
+        clEnumValN(CheckCGProfile, "check-cg",
+                   "checking call graphs (-check-cg)"),
+        clEnumValN(DiagnoseProfile, "diagnose",
+                   "diagnosis, the same as -diagnose"),
+        clEnumValEnd),
+    cl::init(FullProfile));
+static cl::opt<bool> DropIgnoredRecords(
+    "drop-ignored-records",
+    cl::desc("Don't log what -check-aa ignores: NULL pointers, and bitcasts "
+             "and PHINodes, which it never reports. Ignored with -diagnose"));
+static cl::opt<bool> CoalesceFrames(
+    "coalesce-frames",
+    cl::desc("Log the entry-block allocas of a function with one frame record "
+             "instead of one record each. Moves the allocas into one padded "
+             "frame, which changes the stack layout"));
+static cl::opt<bool> GlobalTable(
+    "global-table",
+    cl::desc("Log the global variables and functions from one constant "
+             "table, with a record each, instead of calling HookMemAlloc and "
+             "HookTopLevel for each"));
+static cl::opt<string> ElideDerivedPointers(
+    "elide-derived-pointers",
+    cl::desc("Don't hook bitcasts and GEPs with constant indices of logged "
+             "pointers, and write how to derive their values to this file "
+             "for the log processors' -derivations. Ignored with -diagnose"));
+static cl::opt<bool> HoistInvariantHooks(
+    "hoist-invariant-hooks",
+    cl::desc("Hook pointers that have the same value throughout a loop once "
+             "in the loop's preheader. The baseline AA decides which loads "
+             "are invariant. Ignored with -diagnose"));
+static cl::opt<string> HookAliasChecks(
+    "hook-alias-checks",
+    cl::desc("Hook only the pointers of the alias checks in this file, "
+             "written by -instrument-alias-checker -output-alias-checks, and "
+             "no pointer stores unless -diagnose. The log then has just what "
+             "-check-aa needs to check these pairs"));
+static cl::opt<bool> BatchHooks(
+    "batch-hooks",
+    cl::desc("Hook the pointers defined in a basic block with one call "
+             "before the block calls a function or ends. Ignored with "
+             "-diagnose"));
+static cl::opt<LocalAllocaPolicy> ElideLocalAllocas(
+    "elide-local-allocas",
+    cl::desc("Don't log the allocas that never escape their functions, or "
+             "the pointers into them, trusting the checked AA with aliases "
+             "it decides intra-procedurally. Ignored with -diagnose"),
+    cl::values(
+        clEnumValN(NoLocalAllocas, "none", "log all allocas"),
+        clEnumValN(DirectLocalAllocas, "direct",
+                   "only those loaded from and stored to directly"),
+        clEnumValN(ConstantOffsetLocalAllocas, "constant-offset",
+                   "also those accessed at constant offsets"),
+        clEnumValN(AllLocalAllocas, "all",
+                   "also those accessed at variable offsets or through "
+                   "PHINodes and selects"),
+        clEnumValEnd),
+    cl::init(NoLocalAllocas));
 static cl::list<string> OfflineWhiteList(
     "offline-white-list", cl::desc("Functions which should be hooked"));
 
@@ -110,6 +286,15 @@ ModulePass *neongoby::createMemoryInstrumenterPass() {
 void MemoryInstrumenter::getAnalysisUsage(AnalysisUsage &AU) const {
   AU.addRequired<TargetData>();
   AU.addRequired<IDAssigner>();
+  // runOnModule clears -elide-derived-pointers under -diagnose, but only
+  // after the pass manager has asked for the analyses.
+  bool Diagnosing = Diagnose || Profile == DiagnoseProfile;
+  if ((ElideDerivedPointers != "" && !Diagnosing) || HoistInvariantHooks)
+    AU.addRequired<BaselineAliasAnalysis>();
+  if (HoistInvariantHooks) {
+    AU.addRequired<DominatorTree>();
+    AU.addRequired<LoopInfo>();
+  }
 }
 
 MemoryInstrumenter::MemoryInstrumenter(): ModulePass(ID) {
@@ -121,13 +306,21 @@ MemoryInstrumenter::MemoryInstrumenter(): ModulePass(ID) {
   CallHook = NULL;
   ReturnHook = NULL;
   GlobalsAllocHook = NULL;
+  GlobalsAllocTableHook = NULL;
   BasicBlockHook = NULL;
   VAStartHook = NULL;
+  FrameAllocHook = NULL;
+  MemFreeHook = NULL;
+  TopLevelBatchHook = NULL;
+  TopLevelValueHook = NULL;
+  TopLevelBatchNonNullHook = NULL;
   MemHooksIniter = NULL;
   Main = NULL;
   CharType = LongType = IntType = NULL;
   CharStarType = NULL;
   VoidType = NULL;
+  FrameSlotLayoutType = NULL;
+  GlobalAllocEntryType = NULL;
 }
 
 void MemoryInstrumenter::instrumentMainArgs(Module &M) {
@@ -166,6 +359,83 @@ void MemoryInstrumenter::instrumentAlloca(AllocaInst *AI) {
   instrumentMemoryAllocation(AI, UndefValue::get(LongType), NULL, Loc);
 }
 
+bool MemoryInstrumenter::isCoalescible(AllocaInst *AI) {
+  if (!CoalesceFrames)
+    return false;
+  // Allocas in the entry block run exactly once per invocation.
+  if (AI->getParent() != &AI->getParent()->getParent()->getEntryBlock())
+    return false;
+  if (AI->isArrayAllocation())
+    return false;
+  // A field of the frame is only aligned as its type requires.
+  TargetData &TD = getAnalysis<TargetData>();
+  return AI->getAlignment() <= TD.getABITypeAlignment(AI->getAllocatedType());
+}
+
+void MemoryInstrumenter::instrumentFrame(Function &F) {
+  IDAssigner &IDA = getAnalysis<IDAssigner>();
+  TargetData &TD = getAnalysis<TargetData>();
+
+  unsigned FuncID = IDA.getFunctionID(&F);
+  if (FrameAllocas.empty() || FuncID == IDAssigner::InvalidID) {
+    for (size_t i = 0; i < FrameAllocas.size(); ++i)
+      instrumentAlloca(FrameAllocas[i]);
+    FrameAllocas.clear();
+    return;
+  }
+
+  // Each alloca becomes a field of the frame, followed by a padding byte for
+  // the same reason Preparer pads allocas.
+  vector<Type *> FieldTypes;
+  for (size_t i = 0; i < FrameAllocas.size(); ++i) {
+    FieldTypes.push_back(FrameAllocas[i]->getAllocatedType());
+    FieldTypes.push_back(CharType);
+  }
+  StructType *FrameType = StructType::get(F.getContext(), FieldTypes);
+  const StructLayout *FrameLayout = TD.getStructLayout(FrameType);
+
+  // ng.frame = alloca frame type
+  // slot_i = getelementptr ng.frame, 0, 2 * i
+  // HookFrameAlloc(FuncID, ng.frame, layout, NumSlots)
+  // The EnterHook is inserted before them later.
+  Instruction *Loc = F.begin()->getFirstInsertionPt();
+  AllocaInst *Frame = new AllocaInst(FrameType, "ng.frame", Loc);
+  vector<Constant *> Slots;
+  for (size_t i = 0; i < FrameAllocas.size(); ++i) {
+    AllocaInst *AI = FrameAllocas[i];
+    Value *Indices[2] = {ConstantInt::get(IntType, 0),
+                         ConstantInt::get(IntType, 2 * i)};
+    GetElementPtrInst *Slot = GetElementPtrInst::Create(Frame, Indices,
+                                                        AI->getName(), Loc);
+    AI->replaceAllUsesWith(Slot);
+    CoalescedAllocas.push_back(AI);
+
+    uint64_t Offset = FrameLayout->getElementOffset(2 * i);
+    uint64_t Bound = TD.getTypeStoreSize(AI->getAllocatedType());
+    assert(Offset + Bound <= UINT_MAX);
+    vector<Constant *> Fields;
+    Fields.push_back(ConstantInt::get(IntType, IDA.getValueID(AI)));
+    Fields.push_back(ConstantInt::get(IntType, Offset));
+    Fields.push_back(ConstantInt::get(IntType, Bound));
+    Slots.push_back(ConstantStruct::get(FrameSlotLayoutType, Fields));
+  }
+
+  ArrayType *LayoutType = ArrayType::get(FrameSlotLayoutType, Slots.size());
+  GlobalVariable *Layout = new GlobalVariable(
+      *F.getParent(), LayoutType, true, GlobalValue::InternalLinkage,
+      ConstantArray::get(LayoutType, Slots), "ng.frame.layout");
+
+  vector<Value *> Args;
+  Args.push_back(ConstantInt::get(IntType, FuncID));
+  Args.push_back(new BitCastInst(Frame, CharStarType, "", Loc));
+  Args.push_back(ConstantExpr::getBitCast(
+          Layout, PointerType::getUnqual(FrameSlotLayoutType)));
+  Args.push_back(ConstantInt::get(IntType, Slots.size()));
+  CallInst::Create(FrameAllocHook, Args, "", Loc);
+
+  FrameAllocas.clear();
+}
+
 void MemoryInstrumenter::instrumentMemoryAllocation(Value *Start,
                                                     Value *Size,
                                                     Value *Success,
@@ -299,6 +569,18 @@ void MemoryInstrumenter::instrumentMalloc(const CallSite &CS) {
   instrumentMemoryAllocation(Start, Size, Success, Loc);
 }
 
+void MemoryInstrumenter::instrumentFree(const CallSite &CS) {
+  assert(DynAAUtils::IsFree(CS.getCalledFunction()));
+  assert(CS.arg_size() == 1);
+
+  // Log the free before the block is released, so that no allocation of
+  // another thread reusing the block can be logged before it.
+  Value *Address = CS.getArgument(0);
+  if (Address->getType() != CharStarType)
+    Address = new BitCastInst(Address, CharStarType, "", CS.getInstruction());
+  CallInst::Create(MemFreeHook, Address, "", CS.getInstruction());
+}
+
 void MemoryInstrumenter::checkFeatures(Module &M) {
   // Check whether any memory allocation function can
   // potentially be pointed by function pointers.
@@ -370,6 +652,11 @@ void MemoryInstrumenter::setupHooks(Module &M) {
   assert(M.getFunction(DynAAUtils::MemHooksIniterName) == NULL);
   assert(M.getFunction(DynAAUtils::AfterForkHookName) == NULL);
   assert(M.getFunction(DynAAUtils::BeforeForkHookName) == NULL);
+  assert(M.getFunction(DynAAUtils::FrameAllocHookName) == NULL);
+  assert(M.getFunction(DynAAUtils::MemFreeHookName) == NULL);
+  assert(M.getFunction(DynAAUtils::TopLevelBatchHookName) == NULL);
+  assert(M.getFunction(DynAAUtils::TopLevelValueHookName) == NULL);
+  assert(M.getFunction(DynAAUtils::TopLevelBatchNonNullHookName) == NULL);
 
   // Setup MemAllocHook.
   vector<Type *> ArgTypes;
@@ -397,8 +684,9 @@ void MemoryInstrumenter::setupHooks(Module &M) {
                                        DynAAUtils::MainArgsAllocHookName,
                                        &M);
 
-  // Setup MemHooksIniter.
-  FunctionType *MemHooksIniterType = FunctionType::get(VoidType, false);
+  // Setup MemHooksIniter, which takes the hash of the module.
+  FunctionType *MemHooksIniterType =
+      FunctionType::get(VoidType, Type::getInt64Ty(M.getContext()), false);
   MemHooksIniter = Function::Create(MemHooksIniterType,
                                     GlobalValue::ExternalLinkage,
                                     DynAAUtils::MemHooksIniterName,
@@ -468,6 +756,21 @@ void MemoryInstrumenter::setupHooks(Module &M) {
                                       DynAAUtils::GlobalsAllocHookName,
                                       &M);
 
+  // Setup GlobalsAllocTableHook.
+  GlobalAllocEntryType = StructType::get(IntType, IntType, CharStarType,
+                                         LongType, NULL);
+  ArgTypes.clear();
+  ArgTypes.push_back(PointerType::getUnqual(GlobalAllocEntryType));
+  ArgTypes.push_back(IntType);
+  FunctionType *GlobalsAllocTableHookType = FunctionType::get(VoidType,
+                                                              ArgTypes,
+                                                              false);
+  GlobalsAllocTableHook = Function::Create(
+      GlobalsAllocTableHookType,
+      GlobalValue::ExternalLinkage,
+      DynAAUtils::GlobalsAllocTableHookName,
+      &M);
+
   // Setup BasicBlockHook.
   ArgTypes.clear();
   ArgTypes.push_back(IntType);
@@ -504,6 +807,60 @@ void MemoryInstrumenter::setupHooks(Module &M) {
                                  GlobalValue::ExternalLinkage,
                                  DynAAUtils::VAStartHookName,
                                  &M);
+
+  // Setup FrameAllocHook
+  FrameSlotLayoutType = StructType::get(IntType, IntType, IntType, NULL);
+  ArgTypes.clear();
+  ArgTypes.push_back(IntType);
+  ArgTypes.push_back(CharStarType);
+  ArgTypes.push_back(PointerType::getUnqual(FrameSlotLayoutType));
+  ArgTypes.push_back(IntType);
+  FunctionType *FrameAllocHookType = FunctionType::get(VoidType,
+                                                       ArgTypes,
+                                                       false);
+  FrameAllocHook = Function::Create(FrameAllocHookType,
+                                    GlobalValue::ExternalLinkage,
+                                    DynAAUtils::FrameAllocHookName,
+                                    &M);
+
+  // Setup MemFreeHook
+  FunctionType *MemFreeHookType = FunctionType::get(VoidType,
+                                                    CharStarType,
+                                                    false);
+  MemFreeHook = Function::Create(MemFreeHookType,
+                                 GlobalValue::ExternalLinkage,
+                                 DynAAUtils::MemFreeHookName,
+                                 &M);
+
+  // Setup TopLevelBatchHook
+  ArgTypes.clear();
+  ArgTypes.push_back(PointerType::getUnqual(IntType));
+  ArgTypes.push_back(PointerType::getUnqual(CharStarType));
+  ArgTypes.push_back(IntType);
+  FunctionType *TopLevelBatchHookType = FunctionType::get(VoidType,
+                                                          ArgTypes,
+                                                          false);
+  TopLevelBatchHook = Function::Create(TopLevelBatchHookType,
+                                       GlobalValue::ExternalLinkage,
+                                       DynAAUtils::TopLevelBatchHookName,
+                                       &M);
+  TopLevelBatchNonNullHook = Function::Create(
+      TopLevelBatchHookType,
+      GlobalValue::ExternalLinkage,
+      DynAAUtils::TopLevelBatchNonNullHookName,
+      &M);
+
+  // Setup TopLevelValueHook
+  ArgTypes.clear();
+  ArgTypes.push_back(CharStarType);
+  ArgTypes.push_back(IntType);
+  FunctionType *TopLevelValueHookType = FunctionType::get(VoidType,
+                                                          ArgTypes,
+                                                          false);
+  TopLevelValueHook = Function::Create(TopLevelValueHookType,
+                                       GlobalValue::ExternalLinkage,
+                                       DynAAUtils::TopLevelValueHookName,
+                                       &M);
 }
 
 void MemoryInstrumenter::setupScalarTypes(Module &M) {
@@ -518,13 +875,8 @@ void MemoryInstrumenter::instrumentGlobals(Module &M) {
   TargetData &TD = getAnalysis<TargetData>();
   IDAssigner &IDA = getAnalysis<IDAssigner>();
 
-  // Function HookGlobalsAlloc contains only one basic block.
-  // The BB iterates through all global variables, and calls HookMemAlloc
-  // for each of them.
-  BasicBlock *BB = BasicBlock::Create(M.getContext(), "entry",
-                                      GlobalsAllocHook);
-  Instruction *Ret = ReturnInst::Create(M.getContext(), BB);
-
+  // The global variables and functions to allocate, and their sizes.
+  vector<pair<GlobalValue *, uint64_t> > Globals;
   for (Module::global_iterator GI = M.global_begin(), E = M.global_end();
        GI != E; ++GI) {
     // We are going to delete llvm.global_ctors.
@@ -538,11 +890,7 @@ void MemoryInstrumenter::instrumentGlobals(Module &M) {
       GI->setUnnamedAddr(false);
     }
     uint64_t TypeSize = TD.getTypeStoreSize(GI->getType()->getElementType());
-    instrumentMemoryAllocation(GI,
-                               ConstantInt::get(LongType, TypeSize),
-                               NULL,
-                               Ret);
-    instrumentPointer(GI, NULL, Ret);
+    Globals.push_back(make_pair(GI, TypeSize));
   }
 
   for (Module::iterator F = M.begin(); F != M.end(); ++F) {
@@ -560,12 +908,52 @@ void MemoryInstrumenter::instrumentGlobals(Module &M) {
     }
     uint64_t TypeSize = TD.getTypeStoreSize(F->getType());
     assert(TypeSize == TD.getPointerSize());
-    instrumentMemoryAllocation(F,
-                               ConstantInt::get(LongType, TypeSize),
-                               NULL,
-                               Ret);
-    instrumentPointer(F, NULL, Ret);
+    Globals.push_back(make_pair(F, TypeSize));
+  }
+
+  // Function HookGlobalsAlloc contains only one basic block.
+  BasicBlock *BB = BasicBlock::Create(M.getContext(), "entry",
+                                      GlobalsAllocHook);
+  Instruction *Ret = ReturnInst::Create(M.getContext(), BB);
+
+  if (!GlobalTable) {
+    // The BB iterates through all global variables, and calls HookMemAlloc
+    // for each of them.
+    for (size_t i = 0; i < Globals.size(); ++i) {
+      instrumentMemoryAllocation(Globals[i].first,
+                                 ConstantInt::get(LongType, Globals[i].second),
+                                 NULL,
+                                 Ret);
+      instrumentPointer(Globals[i].first, NULL, Ret);
+    }
+    return;
   }
+
+  // The BB passes a table of all global variables to HookGlobalsAllocTable,
+  // which logs them with a record each.
+  if (Globals.empty())
+    return;
+  vector<Constant *> Entries;
+  for (size_t i = 0; i < Globals.size(); ++i) {
+    GlobalValue *GV = Globals[i].first;
+    vector<Constant *> Fields;
+    Fields.push_back(ConstantInt::get(IntType, IDA.getValueID(GV)));
+    // Whether instrumentPointer would hook GV.
+    Fields.push_back(ConstantInt::get(IntType, needsHook(GV)));
+    Fields.push_back(ConstantExpr::getBitCast(GV, CharStarType));
+    Fields.push_back(ConstantInt::get(LongType, Globals[i].second));
+    Entries.push_back(ConstantStruct::get(GlobalAllocEntryType, Fields));
+  }
+  ArrayType *TableType = ArrayType::get(GlobalAllocEntryType, Entries.size());
+  GlobalVariable *Table = new GlobalVariable(
+      M, TableType, true, GlobalValue::InternalLinkage,
+      ConstantArray::get(TableType, Entries), "ng.globals");
+
+  vector<Value *> Args;
+  Args.push_back(ConstantExpr::getBitCast(
+          Table, PointerType::getUnqual(GlobalAllocEntryType)));
+  Args.push_back(ConstantInt::get(IntType, Entries.size()));
+  CallInst::Create(GlobalsAllocTableHook, Args, "", Ret);
 }
 
 bool MemoryInstrumenter::IsWhiteListed(const Function &F) {
@@ -585,6 +973,26 @@ bool MemoryInstrumenter::runOnModule(Module &M) {
   // Check whether there are unsupported language features.
   checkFeatures(M);
 
+  // -profile=diagnose is the same as -diagnose.
+  if (Profile == DiagnoseProfile)
+    Diagnose = true;
+  assert((!Diagnose || Profile == FullProfile || Profile == DiagnoseProfile) &&
+         "-diagnose conflicts with -profile");
+  // The trace slicer follows NULLs, bitcasts and PHINodes as well.
+  if (Diagnose)
+    DropIgnoredRecords = false;
+  // The trace slicer follows pointers into allocas as well.
+  if (Diagnose)
+    ElideLocalAllocas = NoLocalAllocas;
+  // The trace slicer needs a TopLevel record for every derived pointer too.
+  if (Diagnose)
+    ElideDerivedPointers = "";
+
+  // Hash the module before instrumenting it, as the log processors will see
+  // it.
+  uint64_t ModuleHash =
+      DynAAUtils::GetModuleHash(M, getAnalysis<IDAssigner>());
+
   // Setup scalar types.
   setupScalarTypes(M);
 
@@ -595,6 +1003,9 @@ bool MemoryInstrumenter::runOnModule(Module &M) {
   // Setup hook function declarations.
   setupHooks(M);
 
+  if (HookAliasChecks != "")
+    readAliasChecks();
+
   // Hook global variable allocations.
   instrumentGlobals(M);
 
@@ -604,6 +1015,16 @@ bool MemoryInstrumenter::runOnModule(Module &M) {
       continue;
     if (!IsWhiteListed(*F))
       continue;
+    // Before any hook is inserted, and before the other passes over F ask
+    // needsHook.
+    if (ElideLocalAllocas != NoLocalAllocas)
+      findLocalPointers(*F);
+    // Before any hook is inserted.
+    if (ElideDerivedPointers != "")
+      findDerivedPointers(*F);
+    // The trace slicer replays records in the order the program logs them.
+    if (HoistInvariantHooks && !Diagnose)
+      findInvariantPointers(*F);
     // The second argument of main(int argc, char *argv[]) needs special
     // handling, which is done in instrumentMainArgs.
     // We should treat argv as a memory allocation instead of a regular
@@ -618,8 +1039,30 @@ bool MemoryInstrumenter::runOnModule(Module &M) {
       for (BasicBlock::iterator I = BB->begin(); I != BB->end(); ++I)
         instrumentInstructionIfNecessary(I);
     }
+    instrumentFrame(*F);
     instrumentEntry(*F);
+    // The trace slicer needs the TopLevel records between the Store records
+    // the program logs them between.
+    if (BatchHooks && !Diagnose)
+      batchTopLevelHooks(*F);
+    // After batching, which would split the runs otherwise.
+    if (DropIgnoredRecords)
+      guardTopLevelHooks(*F);
   }
+  // Derivations may refer to coalesced allocas.
+  if (ElideDerivedPointers != "")
+    writeDerivations(M);
+  if (HoistInvariantHooks && !Diagnose) {
+    errs() << "# of hoisted invariant pointers = " << InvariantPointers.size()
+        << "\n";
+  }
+  if (ElideLocalAllocas != NoLocalAllocas) {
+    errs() << "# of unlogged local pointers = " << LocalPointers.size()
+        << "\n";
+  }
+  for (size_t i = 0; i < CoalescedAllocas.size(); ++i)
+    CoalescedAllocas[i]->eraseFromParent();
+  CoalescedAllocas.clear();
 
   // main(argc, argv)
   // argv is allocated by outside.
@@ -636,7 +1079,10 @@ bool MemoryInstrumenter::runOnModule(Module &M) {
   // Call the memory hook initializer and the global variable allocation hook
   // at the very beginning.
   Instruction *OldEntry = Main->begin()->getFirstNonPHI();
-  CallInst::Create(MemHooksIniter, "", OldEntry);
+  CallInst::Create(MemHooksIniter,
+                   ConstantInt::get(Type::getInt64Ty(M.getContext()),
+                                    ModuleHash),
+                   "", OldEntry);
   CallInst::Create(GlobalsAllocHook, "", OldEntry);
 
   return true;
@@ -816,7 +1262,9 @@ void MemoryInstrumenter::instrumentInstructionIfNecessary(Instruction *I) {
   // Instrument pointer stores, i.e. store X *, X **.
   // store long, long * is considered as a pointer store as well.
   if (StoreInst *SI = dyn_cast<StoreInst>(I)) {
-    instrumentStoreInst(SI);
+    // Checking aliases or call graphs needs no Store records.
+    if (Diagnose || (HookAliasChecks == "" && Profile == FullProfile))
+      instrumentStoreInst(SI);
     return;
   }
 
@@ -842,6 +1290,8 @@ void MemoryInstrumenter::instrumentInstructionIfNecessary(Instruction *I) {
     Function *Callee = CS.getCalledFunction();
     if (Callee && DynAAUtils::IsMalloc(Callee))
       instrumentMalloc(CS);
+    if (Callee && DynAAUtils::IsFree(Callee))
+      instrumentFree(CS);
     if (Diagnose || Callee == NULL || Callee->isVarArg()) {
       // Instrument a callsite if we are in the diagnosis mode (for TraceSlicer
       // and Reducer), or it has variable length arguments.
@@ -855,9 +1305,17 @@ void MemoryInstrumenter::instrumentInstructionIfNecessary(Instruction *I) {
     }
   }
 
-  // Instrument AllocaInsts.
-  if (AllocaInst *AI = dyn_cast<AllocaInst>(I))
-    instrumentAlloca(AI);
+  // Instrument AllocaInsts. Those in the entry block are instrumented at once
+  // by instrumentFrame.
+  if (AllocaInst *AI = dyn_cast<AllocaInst>(I)) {
+    // Nothing logged points to a local alloca.
+    if (LocalPointers.count(AI))
+      return;
+    if (isCoalescible(AI))
+      FrameAllocas.push_back(AI);
+    else
+      instrumentAlloca(AI);
+  }
 }
 
 void MemoryInstrumenter::instrumentBasicBlock(BasicBlock *BB) {
@@ -935,9 +1393,39 @@ void MemoryInstrumenter::instrumentPointer(Value *ValueOperand,
       return;
   }
 
+  // opt: skip pointers in no alias check
+  if (HookAliasChecks != "" && !CheckedPointers.count(ValueOperand))
+    return;
+
+  if (!IsReadByProfile(ValueOperand))
+    return;
+
+  // The checked AA decides its aliases intra-procedurally.
+  if (LocalPointers.count(ValueOperand))
+    return;
+
+  // The log processors derive its value from another pointer's.
+  if (Derivations.count(ValueOperand))
+    return;
+
+  // Recompute the invariant pointer in the preheader, and hook it there.
+  if (Instruction *I = dyn_cast<Instruction>(ValueOperand)) {
+    if (Instruction *PreheaderEnd = InvariantPointers.lookup(I)) {
+      ValueOperand = I->clone();
+      cast<Instruction>(ValueOperand)->insertBefore(PreheaderEnd);
+      DefLoc = PreheaderEnd;
+    }
+  }
+
   // Add a hook to define this pointer.
   vector<Value *> Args;
   Args.push_back(new BitCastInst(ValueOperand, CharStarType, "", DefLoc));
+  // Only diagnosis reads LoadedFrom.
+  if (Profile == CheckAAProfile || Profile == CheckCGProfile) {
+    Args.push_back(ConstantInt::get(IntType, ValueID));
+    CallInst::Create(TopLevelValueHook, Args, "", DefLoc);
+    return;
+  }
   if (PointerOperand != NULL)
     Args.push_back(new BitCastInst(PointerOperand, CharStarType, "", DefLoc));
   else
@@ -968,3 +1456,472 @@ void MemoryInstrumenter::instrumentPointerParameters(Function *F) {
     }
   }
 }
+
+bool MemoryInstrumenter::needsHook(Value *V) {
+  IDAssigner &IDA = getAnalysis<IDAssigner>();
+  if (IDA.getValueID(V) == IDAssigner::InvalidID)
+    return false;
+  if (HookAliasChecks != "" && !CheckedPointers.count(V))
+    return false;
+  if (!IsReadByProfile(V))
+    return false;
+  if (LocalPointers.count(V))
+    return false;
+  return HookAllPointers || DynAAUtils::PointerIsDereferenced(V);
+}
+
+bool MemoryInstrumenter::IsReadByProfile(Value *V) {
+  // AliasAnalysisChecker never reports a missing alias involving a bitcast or
+  // a PHINode.
+  if (DropIgnoredRecords && Profile != CheckCGProfile &&
+      (isa<BitCastInst>(V) || isa<PHINode>(V)))
+    return false;
+  if (Profile != CheckCGProfile)
+    return true;
+  // The call graph checker asks which functions each called pointer aliases.
+  if (isa<Function>(V))
+    return true;
+  for (Value::use_iterator UI = V->use_begin(); UI != V->use_end(); ++UI) {
+    CallSite CS(*UI);
+    if (CS && CS.getCalledValue() == V)
+      return true;
+  }
+  return false;
+}
+
+void MemoryInstrumenter::readAliasChecks() {
+  IDAssigner &IDA = getAnalysis<IDAssigner>();
+
+  FILE *InputFile = fopen(HookAliasChecks.c_str(), "r");
+  assert(InputFile && "The alias checks file doesn't exist.");
+  unsigned FuncID, InsID1, InsID2;
+  while (fscanf(InputFile, "%u: %u %u", &FuncID, &InsID1, &InsID2) == 3) {
+    Instruction *I1 = IDA.getInstruction(InsID1);
+    Instruction *I2 = IDA.getInstruction(InsID2);
+    assert(I1 && I2 && "The alias checks are of another program.");
+    CheckedPointers.insert(I1);
+    CheckedPointers.insert(I2);
+  }
+  fclose(InputFile);
+  errs() << "# of pointers in alias checks = " << CheckedPointers.size()
+      << "\n";
+}
+
+void MemoryInstrumenter::findDerivedPointers(Function &F) {
+  TargetData &TD = getAnalysis<TargetData>();
+  AliasAnalysis &AA = getAnalysis<BaselineAliasAnalysis>();
+
+  for (Function::iterator BB = F.begin(); BB != F.end(); ++BB) {
+    // The pointers of BB whose records the log processors will have, either
+    // logged or derived. A derived pointer's record is synthesized right
+    // after its base's, so the derived pointer must be computed whenever the
+    // base is logged: the base is logged in BB (or at the entry of F for
+    // arguments), and no call between them may leave BB.
+    DenseSet<Value *> Logged;
+    // The loads of BB whose locations have not been modified since.
+    vector<LoadInst *> AvailableLoads;
+    if (BB == F.begin()) {
+      for (Function::arg_iterator AI = F.arg_begin(); AI != F.arg_end();
+           ++AI) {
+        // argv of main is logged as an allocation instead.
+        if (AI->getType()->isPointerTy() && &F != Main && needsHook(AI))
+          Logged.insert(AI);
+      }
+    }
+    for (BasicBlock::iterator I = BB->begin(); I != BB->end(); ++I) {
+      // The callee may not return, e.g. exit or longjmp.
+      if (isa<CallInst>(I) && !isa<IntrinsicInst>(I)) {
+        Logged.clear();
+        AvailableLoads.clear();
+      } else if (I->mayWriteToMemory()) {
+        vector<LoadInst *> StillAvailable;
+        for (size_t i = 0; i < AvailableLoads.size(); ++i) {
+          AliasAnalysis::Location Loc = AA.getLocation(AvailableLoads[i]);
+          if (!(AA.getModRefInfo(I, Loc) & AliasAnalysis::Mod))
+            StillAvailable.push_back(AvailableLoads[i]);
+        }
+        AvailableLoads.swap(StillAvailable);
+      }
+      // The hook of an InvokeInst is in its normal destination.
+      if (!I->getType()->isPointerTy() || I->isTerminator())
+        continue;
+      if (!needsHook(I))
+        continue;
+      Value *Base = NULL;
+      int64_t Offset = 0;
+      if (BitCastInst *BCI = dyn_cast<BitCastInst>(I)) {
+        Base = BCI->getOperand(0);
+      } else if (GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(I)) {
+        if (GEP->hasAllConstantIndices()) {
+          Base = GEP->getPointerOperand();
+          SmallVector<Value *, 8> Indices(GEP->idx_begin(), GEP->idx_end());
+          Offset = (int64_t)TD.getIndexedOffset(Base->getType(), Indices);
+        }
+      } else if (LoadInst *LI = dyn_cast<LoadInst>(I)) {
+        // A load dominated by a logged load of the same location loads the
+        // same pointer.
+        if (LI->isSimple()) {
+          for (size_t i = 0; i < AvailableLoads.size(); ++i) {
+            if (AvailableLoads[i]->getPointerOperand() ==
+                LI->getPointerOperand() &&
+                AvailableLoads[i]->getType() == LI->getType()) {
+              Base = AvailableLoads[i];
+              break;
+            }
+          }
+          AvailableLoads.push_back(LI);
+        }
+      }
+      if (Base && Base->getType()->isPointerTy() && Logged.count(Base)) {
+        // Derive from the base's base, so that the log processors resolve
+        // each derivation in one step.
+        DenseMap<Value *, pair<Value *, int64_t> >::iterator J =
+            Derivations.find(Base);
+        if (J != Derivations.end()) {
+          Base = J->second.first;
+          Offset += J->second.second;
+        }
+        Derivations[I] = make_pair(Base, Offset);
+      }
+      Logged.insert(I);
+    }
+  }
+}
+
+void MemoryInstrumenter::findLocalPointers(Function &F) {
+  IDAssigner &IDA = getAnalysis<IDAssigner>();
+
+  for (Function::iterator BB = F.begin(); BB != F.end(); ++BB) {
+    for (BasicBlock::iterator I = BB->begin(); I != BB->end(); ++I) {
+      AllocaInst *AI = dyn_cast<AllocaInst>(I);
+      if (!AI || IDA.getValueID(AI) == IDAssigner::InvalidID)
+        continue;
+      // A returned or stored alloca escapes as well.
+      if (PointerMayBeCaptured(AI, true, true))
+        continue;
+      DenseSet<Value *> Pointers;
+      if (collectLocalPointers(AI, Pointers))
+        LocalPointers.insert(Pointers.begin(), Pointers.end());
+    }
+  }
+}
+
+// Whether <Call> only accesses the memory of a local alloca passed to it,
+// without defining a hooked pointer to it: memset, memcpy, memmove, and the
+// lifetime and debug markers.
+static bool IsLocalCallUse(Instruction *Call) {
+  if (isa<MemIntrinsic>(Call) || isa<DbgInfoIntrinsic>(Call))
+    return true;
+  if (IntrinsicInst *II = dyn_cast<IntrinsicInst>(Call)) {
+    return II->getIntrinsicID() == Intrinsic::lifetime_start ||
+        II->getIntrinsicID() == Intrinsic::lifetime_end;
+  }
+  return false;
+}
+
+bool MemoryInstrumenter::collectLocalPointers(AllocaInst *AI,
+                                              DenseSet<Value *> &Pointers) {
+  vector<Value *> WorkList;
+  Pointers.insert(AI);
+  WorkList.push_back(AI);
+  while (!WorkList.empty()) {
+    Value *P = WorkList.back();
+    WorkList.pop_back();
+    for (Value::use_iterator UI = P->use_begin(); UI != P->use_end(); ++UI) {
+      Instruction *U = dyn_cast<Instruction>(*UI);
+      // Even a nocapture callee hooks its pointer arguments, which would then
+      // point to an unlogged allocation, and the checked AA decides their
+      // aliases inter-procedurally.
+      if (U && (isa<CallInst>(U) || isa<InvokeInst>(U)) &&
+          !IsLocalCallUse(U))
+        return false;
+      // Stores and comparisons derive no pointer, and a load loads one from
+      // elsewhere. Other derivations would have captured AI.
+      if (!U || !U->getType()->isPointerTy() || isa<LoadInst>(U))
+        continue;
+      if (Pointers.count(U))
+        continue;
+      if (ElideLocalAllocas == DirectLocalAllocas)
+        return false;
+      if (GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(U)) {
+        if (!GEP->hasAllConstantIndices() &&
+            ElideLocalAllocas != AllLocalAllocas)
+          return false;
+      } else if (isa<PHINode>(U) || isa<SelectInst>(U)) {
+        if (ElideLocalAllocas != AllLocalAllocas)
+          return false;
+      } else if (!isa<BitCastInst>(U)) {
+        return false;
+      }
+      Pointers.insert(U);
+      WorkList.push_back(U);
+    }
+  }
+  // A PHINode or select that may also pick a pointer not into AI must be
+  // logged, and then AI must be allocated.
+  for (DenseSet<Value *>::iterator I = Pointers.begin(); I != Pointers.end();
+       ++I) {
+    if (PHINode *PN = dyn_cast<PHINode>(*I)) {
+      for (unsigned i = 0; i < PN->getNumIncomingValues(); ++i) {
+        if (!Pointers.count(PN->getIncomingValue(i)))
+          return false;
+      }
+    } else if (SelectInst *SI = dyn_cast<SelectInst>(*I)) {
+      if (!Pointers.count(SI->getTrueValue()) ||
+          !Pointers.count(SI->getFalseValue()))
+        return false;
+    }
+  }
+  return true;
+}
+
+void MemoryInstrumenter::writeDerivations(Module &M) {
+  IDAssigner &IDA = getAnalysis<IDAssigner>();
+
+  string ErrorInfo;
+  raw_fd_ostream Output(ElideDerivedPointers.c_str(), ErrorInfo);
+  if (!ErrorInfo.empty()) {
+    errs() << "Cannot write " << ElideDerivedPointers << ": " << ErrorInfo
+        << "\n";
+    assert(false);
+  }
+  // One line per derived pointer: its value ID, the value ID of its base, and
+  // the byte offset from the base.
+  for (DenseMap<Value *, pair<Value *, int64_t> >::iterator
+       I = Derivations.begin(); I != Derivations.end(); ++I) {
+    Output << IDA.getValueID(I->first) << " "
+        << IDA.getValueID(I->second.first) << " " << I->second.second << "\n";
+  }
+  errs() << "# of elided derived pointers = " << Derivations.size() << "\n";
+}
+
+void MemoryInstrumenter::findInvariantPointers(Function &F) {
+  // Each getAnalysis<...>(F) reruns all the function passes this pass
+  // requires on F, so LoopInfo must be the last, otherwise its loops would be
+  // freed.
+  DominatorTree &DT = getAnalysis<DominatorTree>(F);
+  LoopInfo &LI = getAnalysis<LoopInfo>(F);
+
+  CallFreeLoops.clear();
+  for (Function::iterator BB = F.begin(); BB != F.end(); ++BB) {
+    Loop *L = LI.getLoopFor(BB);
+    if (!L)
+      continue;
+    for (BasicBlock::iterator I = BB->begin(); I != BB->end(); ++I) {
+      if (!isa<LoadInst>(I) && !isa<GetElementPtrInst>(I) &&
+          !isa<BitCastInst>(I))
+        continue;
+      if (!I->getType()->isPointerTy() || !needsHook(I))
+        continue;
+      // Hoist to the outermost loop in which it is invariant.
+      Loop *Outermost = NULL;
+      for (Loop *Cur = L; Cur && isInvariantInLoop(I, Cur, DT);
+           Cur = Cur->getParentLoop())
+        Outermost = Cur;
+      if (Outermost)
+        InvariantPointers[I] = Outermost->getLoopPreheader()->getTerminator();
+    }
+  }
+}
+
+bool MemoryInstrumenter::isInvariantInLoop(Instruction *I, Loop *L,
+                                           DominatorTree &DT) {
+  AliasAnalysis &AA = getAnalysis<BaselineAliasAnalysis>();
+
+  if (!L->getLoopPreheader() || !L->hasLoopInvariantOperands(I))
+    return false;
+  if (!isCallFree(L))
+    return false;
+
+  // I must run in the first iteration, so that hooking it in the preheader
+  // doesn't log a value the program never computes.
+  SmallVector<BasicBlock *, 8> ExitingBlocks;
+  L->getExitingBlocks(ExitingBlocks);
+  if (ExitingBlocks.empty())
+    return false;
+  for (size_t i = 0; i < ExitingBlocks.size(); ++i) {
+    if (!DT.dominates(I->getParent(), ExitingBlocks[i]))
+      return false;
+  }
+
+  // A load is invariant if nothing in the loop may modify its location.
+  if (LoadInst *Load = dyn_cast<LoadInst>(I)) {
+    if (!Load->isSimple())
+      return false;
+    AliasAnalysis::Location Loc = AA.getLocation(Load);
+    for (Loop::block_iterator BI = L->block_begin(); BI != L->block_end();
+         ++BI) {
+      for (BasicBlock::iterator J = (*BI)->begin(); J != (*BI)->end(); ++J) {
+        if (J->mayWriteToMemory() &&
+            (AA.getModRefInfo(J, Loc) & AliasAnalysis::Mod))
+          return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool MemoryInstrumenter::isCallFree(Loop *L) {
+  DenseMap<Loop *, bool>::iterator Cached = CallFreeLoops.find(L);
+  if (Cached != CallFreeLoops.end())
+    return Cached->second;
+
+  bool CallFree = true;
+  for (Loop::block_iterator BI = L->block_begin();
+       CallFree && BI != L->block_end(); ++BI) {
+    for (BasicBlock::iterator I = (*BI)->begin(); I != (*BI)->end(); ++I) {
+      if (isa<AllocaInst>(I) || isa<InvokeInst>(I) ||
+          (isa<CallInst>(I) && !isa<DbgInfoIntrinsic>(I))) {
+        CallFree = false;
+        break;
+      }
+    }
+  }
+  CallFreeLoops[L] = CallFree;
+  return CallFree;
+}
+
+void MemoryInstrumenter::batchTopLevelHooks(Function &F) {
+  // Find the runs first, because batching them inserts calls.
+  vector<pair<vector<CallInst *>, Instruction *> > Runs;
+  size_t MaxRunSize = 0;
+  for (Function::iterator BB = F.begin(); BB != F.end(); ++BB) {
+    vector<CallInst *> Hooks;
+    for (BasicBlock::iterator I = BB->begin(); I != BB->end(); ++I) {
+      CallInst *CI = dyn_cast<CallInst>(I);
+      if (CI && (CI->getCalledFunction() == TopLevelHook ||
+                 CI->getCalledFunction() == TopLevelValueHook)) {
+        Hooks.push_back(CI);
+        continue;
+      }
+      // Moving TopLevel records past Store records is fine, but not past
+      // allocations, frees, function entries and returns, which change how
+      // the log processors interpret the addresses.
+      if (CI && (CI->getCalledFunction() == StoreHook ||
+                 isa<DbgInfoIntrinsic>(CI)))
+        continue;
+      if (!CI && !isa<AllocaInst>(I) && !I->isTerminator())
+        continue;
+      // A single hook is cheaper called directly.
+      if (Hooks.size() > 1) {
+        Runs.push_back(make_pair(Hooks, (Instruction *)I));
+        MaxRunSize = max(MaxRunSize, Hooks.size());
+      }
+      Hooks.clear();
+    }
+  }
+  if (Runs.empty())
+    return;
+
+  // ng.batch = alloca [2 * MaxRunSize x i8*]
+  // One buffer for the whole function, filled right before each batch.
+  ArrayType *BatchType = ArrayType::get(CharStarType, 2 * MaxRunSize);
+  AllocaInst *Batch = new AllocaInst(BatchType, "ng.batch",
+                                     F.begin()->getFirstInsertionPt());
+  for (size_t i = 0; i < Runs.size(); ++i)
+    emitTopLevelBatch(Runs[i].first, Batch, Runs[i].second);
+}
+
+void MemoryInstrumenter::emitTopLevelBatch(const vector<CallInst *> &Hooks,
+                                           AllocaInst *Batch,
+                                           Instruction *Loc) {
+  // ng.batch[2 * i] = pointee address of pointer i
+  // ng.batch[2 * i + 1] = the address it is loaded from, or null
+  // HookTopLevelBatch(value IDs, ng.batch, NumPointers)
+  vector<Constant *> ValueIDs;
+  for (size_t i = 0; i < Hooks.size(); ++i) {
+    CallInst *Hook = Hooks[i];
+    // TopLevelValueHook has no LoadedFrom.
+    bool HasLoadedFrom = (Hook->getCalledFunction() == TopLevelHook);
+    Value *Fields[2] = {Hook->getArgOperand(0),
+                        HasLoadedFrom ? Hook->getArgOperand(1) :
+                            ConstantPointerNull::get(CharStarType)};
+    for (unsigned j = 0; j < 2; ++j) {
+      Value *Indices[2] = {ConstantInt::get(IntType, 0),
+                           ConstantInt::get(IntType, 2 * i + j)};
+      GetElementPtrInst *Slot = GetElementPtrInst::Create(Batch, Indices, "",
+                                                          Loc);
+      new StoreInst(Fields[j], Slot, Loc);
+    }
+    ValueIDs.push_back(cast<Constant>(
+            Hook->getArgOperand(HasLoadedFrom ? 2 : 1)));
+    Hook->eraseFromParent();
+  }
+
+  ArrayType *DescriptorType = ArrayType::get(IntType, ValueIDs.size());
+  GlobalVariable *Descriptor = new GlobalVariable(
+      *Loc->getParent()->getParent()->getParent(), DescriptorType, true,
+      GlobalValue::InternalLinkage,
+      ConstantArray::get(DescriptorType, ValueIDs), "ng.batch.ids");
+
+  Value *Indices[2] = {ConstantInt::get(IntType, 0),
+                       ConstantInt::get(IntType, 0)};
+  vector<Value *> Args;
+  Args.push_back(ConstantExpr::getBitCast(
+          Descriptor, PointerType::getUnqual(IntType)));
+  Args.push_back(GetElementPtrInst::Create(Batch, Indices, "", Loc));
+  Args.push_back(ConstantInt::get(IntType, Hooks.size()));
+  CallInst::Create(DropIgnoredRecords ? TopLevelBatchNonNullHook :
+                       TopLevelBatchHook,
+                   Args, "", Loc);
+}
+
+void MemoryInstrumenter::guardTopLevelHooks(Function &F) {
+  vector<CallInst *> Hooks;
+  for (Function::iterator BB = F.begin(); BB != F.end(); ++BB) {
+    for (BasicBlock::iterator I = BB->begin(); I != BB->end(); ++I) {
+      CallInst *CI = dyn_cast<CallInst>(I);
+      if (!CI || (CI->getCalledFunction() != TopLevelHook &&
+                  CI->getCalledFunction() != TopLevelValueHook))
+        continue;
+      // Allocas, frame slots and globals are never NULL.
+      Value *Pointer = CI->getArgOperand(0)->stripPointerCasts();
+      if (GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(Pointer)) {
+        if (GEP->isInBounds())
+          Pointer = GEP->getPointerOperand();
+      }
+      if (isa<AllocaInst>(Pointer) || isa<GlobalValue>(Pointer))
+        continue;
+      Hooks.push_back(CI);
+    }
+  }
+
+  // instrumentPointerParameters hooks the arguments at the entry block's
+  // first insertion point, which may precede some allocas. Splitting there
+  // would move those allocas to ng.cont, out of the entry block, so hoist
+  // them above the first guarded hook beforehand. Their sizes are constants.
+  BasicBlock *Entry = F.begin();
+  for (size_t i = 0; i < Hooks.size(); ++i) {
+    if (Hooks[i]->getParent() != Entry)
+      continue;
+    BasicBlock::iterator I = Hooks[i];
+    while (I != Entry->end()) {
+      AllocaInst *AI = dyn_cast<AllocaInst>(I++);
+      if (AI && isa<Constant>(AI->getArraySize()))
+        AI->moveBefore(Hooks[i]);
+    }
+    break;
+  }
+
+  // BB:
+  //   ...
+  //   br (p == NULL), ng.cont, ng.nonnull
+  // ng.nonnull:
+  //   HookTopLevel(p, ...)
+  //   br ng.cont
+  // ng.cont:
+  //   ...
+  for (size_t i = 0; i < Hooks.size(); ++i) {
+    CallInst *Hook = Hooks[i];
+    BasicBlock *BB = Hook->getParent();
+    BasicBlock *NonNull = BB->splitBasicBlock(Hook, "ng.nonnull");
+    BasicBlock::iterator AfterHook = Hook; ++AfterHook;
+    BasicBlock *Cont = NonNull->splitBasicBlock(AfterHook, "ng.cont");
+    TerminatorInst *OldTerm = BB->getTerminator();
+    Value *IsNull = new ICmpInst(OldTerm, ICmpInst::ICMP_EQ,
+                                 Hook->getArgOperand(0),
+                                 ConstantPointerNull::get(CharStarType));
+    BranchInst::Create(Cont, NonNull, IsNull, OldTerm);
+    OldTerm->eraseFromParent();
+  }
+}
@@ -120,6 +120,7 @@ void Reducer::tagPointers(Module &M) {
 
 bool Reducer::runOnModule(Module &M) {
   // get executed functions and basic blocks from pointer logs
+  setModuleHash(DynAAUtils::GetModuleHash(M, getAnalysis<IDAssigner>()));
   processLog();
 
   // add metadata for input pointers
@@ -24,6 +24,13 @@ void LogDumper::beforeRecord(const LogRecord &Record) {
     case LogRecord::Call      : printf("[    call] "); break;
     case LogRecord::Return    : printf("[  return] "); break;
     case LogRecord::BasicBlock: printf("[      bb] "); break;
+    // LogProcessor expands frame and global records into MemAllocRecords
+    // and TopLevelRecords.
+    case LogRecord::FrameSlot : break;
+    case LogRecord::FrameAlloc: break;
+    case LogRecord::GlobalAlloc: break;
+    // Frames are freed without a record, so processMemFree prints the tag.
+    case LogRecord::MemFree   : break;
   }
 }
 
@@ -61,3 +68,7 @@ void LogDumper::processReturn(const ReturnRecord &Record) {
 void LogDumper::processBasicBlock(const BasicBlockRecord &Record) {
   printf("%u: bb\n", Record.ValueID);
 }
+
+void LogDumper::processMemFree(const MemFreeRecord &Record) {
+  printf("[    free] %p\n", Record.Address);
+}
@@ -1,19 +1,37 @@
 #define DEBUG_TYPE "dyn-aa"
 
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cerrno>
 #include <string>
 #include <cstdio>
+#include <ctime>
+#include <deque>
 #include <iostream>
+#include <map>
+#include <queue>
+#include <set>
+#include <vector>
+
+#ifdef NG_HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/Twine.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 
 #include "dyn-aa/Utils.h"
+#include "dyn-aa/LogFormat.h"
 #include "dyn-aa/LogProcessor.h"
+#include "dyn-aa/LogStream.h"
 
 using namespace std;
 using namespace llvm;
@@ -24,6 +42,34 @@ static cl::list<string> LogFileNames(
     cl::desc("Point-to log files generated "
              "by running the instrumented program"));
 
+static cl::opt<bool> MergeLogs(
+    "merge-logs",
+    cl::desc("Process the records of all log files in the order of their "
+             "stamps, as if they were one log. Requires LOG_STAMP"));
+
+static cl::opt<string> LogShm(
+    "log-shm",
+    cl::desc("Process the records the instrumented program streams through "
+             "this shared memory object (LOG_WRITER=shm), e.g. /neongoby, "
+             "instead of log files. Start before the program"));
+
+static cl::opt<unsigned> LogShmSlots(
+    "log-shm-slots",
+    cl::desc("The number of threads that can stream records through -log-shm"),
+    cl::init(256));
+
+static cl::opt<unsigned> LogShmRingSize(
+    "log-shm-ring-size",
+    cl::desc("The ring size of each thread streaming through -log-shm, "
+             "rounded up to a power of two"),
+    cl::init(4 * 1024 * 1024));
+
+static cl::opt<string> Derivations(
+    "derivations",
+    cl::desc("The file written by -elide-derived-pointers when instrumenting "
+             "the program. The TopLevel records of the elided pointers are "
+             "derived from their bases'"));
+
 STATISTIC(NumMemAllocRecords, "Number of memory allocation records");
 STATISTIC(NumTopLevelRecords, "Number of top-level records");
 STATISTIC(NumEnterRecords, "Number of enter records");
@@ -31,11 +77,411 @@ STATISTIC(NumStoreRecords, "Number of store records");
 STATISTIC(NumCallRecords, "Number of call records");
 STATISTIC(NumReturnRecords, "Number of return records");
 STATISTIC(NumBasicBlockRecords, "Number of basic block records");
+STATISTIC(NumMemFreeRecords, "Number of memory free records");
 STATISTIC(NumRecords, "Number of all records");
 
+namespace {
+// Decodes records of a versioned log in the forward direction.
+struct RecordReader {
+  static const size_t BufferSize = 1024 * 1024;
+
+  // Decodes the records between <Offset> and <End> of <LogFile>, starting
+  // with codec state <State>.
+  RecordReader(FILE *LogFile, uint16_t Flags, off_t Offset, off_t End,
+               const LogCodecState &State):
+      LogFile(LogFile), Flags(Flags), Buffer(BufferSize), BufferBegin(0),
+      BufferEnd(0), Offset(Offset), NumBytesLeft(End - Offset), State(State) {
+    fseeko(LogFile, Offset, SEEK_SET);
+  }
+
+  // Reads the next record. Returns false at the end, including the zero
+  // padding left by the mmap writer and a truncated last record.
+  bool next(LogRecord &Record, uint64_t &Stamp) {
+    if (BufferEnd - BufferBegin < LogFormat::MaxEncodedSize &&
+        NumBytesLeft > 0) {
+      // Move the leftover to the front, and refill the buffer.
+      memmove(&Buffer[0], &Buffer[BufferBegin], BufferEnd - BufferBegin);
+      BufferEnd -= BufferBegin;
+      BufferBegin = 0;
+      size_t Size = fread(&Buffer[BufferEnd], 1,
+                          min((off_t)(BufferSize - BufferEnd), NumBytesLeft),
+                          LogFile);
+      BufferEnd += Size;
+      // Stop early if the file is shorter than expected.
+      NumBytesLeft = (Size == 0 ? 0 : NumBytesLeft - Size);
+    }
+    size_t Size = LogFormat::Decode(&Buffer[BufferBegin],
+                                    BufferEnd - BufferBegin, Record, Stamp,
+                                    Flags, State);
+    BufferBegin += Size;
+    Offset += Size;
+    return Size > 0;
+  }
+
+  // Returns the file offset of the next record.
+  off_t tell() const { return Offset; }
+  // Returns the codec state before the next record.
+  const LogCodecState &getState() const { return State; }
+
+ private:
+  FILE *LogFile;
+  uint16_t Flags;
+  vector<char> Buffer;
+  size_t BufferBegin, BufferEnd;
+  off_t Offset, NumBytesLeft;
+  LogCodecState State;
+};
+
+// Where to resume decoding a versioned log.
+struct Checkpoint {
+  Checkpoint(size_t RangeID, off_t Offset, const LogCodecState &State):
+      RangeID(RangeID), Offset(Offset), State(State) {}
+
+  size_t RangeID;
+  off_t Offset;
+  LogCodecState State;
+};
+
+// A block of a compressed log.
+struct BlockLocation {
+  BlockLocation(FILE *LogFile, uint16_t Flags, off_t Offset,
+                const LogBlockHeader &Header):
+      LogFile(LogFile), Flags(Flags), Offset(Offset), Header(Header),
+      Padding(0) {}
+
+  // The bytes the block accounts for in the log.
+  uint64_t getSize() const {
+    return sizeof(LogBlockHeader) + Header.CompressedSize + Padding;
+  }
+
+  FILE *LogFile;
+  uint16_t Flags;
+  off_t Offset;
+  LogBlockHeader Header;
+  // The padding of the segment after the block, if it is the last block of a
+  // segment.
+  uint64_t Padding;
+};
+
+// Reads and decompresses the blocks of a compressed log on a separate thread,
+// so that decompression overlaps with processing the previous block.
+struct BlockPrefetcher {
+  // At most this many decompressed blocks wait to be processed.
+  static const size_t MaxNumReady = 2;
+
+  // Prefetches <Blocks> in the given order.
+  BlockPrefetcher(const vector<BlockLocation> &Blocks):
+      Blocks(Blocks), Done(false), Stopping(false) {
+    pthread_mutex_init(&Mutex, NULL);
+    pthread_cond_init(&Cond, NULL);
+    int R = pthread_create(&Thread, NULL, Run, this);
+    assert(R == 0);
+  }
+
+  ~BlockPrefetcher() {
+    pthread_mutex_lock(&Mutex);
+    Stopping = true;
+    pthread_cond_broadcast(&Cond);
+    pthread_mutex_unlock(&Mutex);
+    pthread_join(Thread, NULL);
+    for (size_t i = 0; i < Ready.size(); ++i)
+      delete Ready[i];
+    pthread_cond_destroy(&Cond);
+    pthread_mutex_destroy(&Mutex);
+  }
+
+  // Moves the next decompressed block into <Raw>. Returns false after the
+  // last block or a block that fails to decompress.
+  bool next(vector<char> &Raw) {
+    pthread_mutex_lock(&Mutex);
+    while (Ready.empty() && !Done)
+      pthread_cond_wait(&Cond, &Mutex);
+    bool Found = !Ready.empty();
+    if (Found) {
+      Raw.swap(*Ready.front());
+      delete Ready.front();
+      Ready.pop_front();
+      pthread_cond_broadcast(&Cond);
+    }
+    pthread_mutex_unlock(&Mutex);
+    return Found;
+  }
+
+ private:
+  static void *Run(void *Arg) {
+    ((BlockPrefetcher *)Arg)->run();
+    return NULL;
+  }
+
+  void run() {
+    vector<char> Compressed;
+    for (size_t i = 0; i < Blocks.size(); ++i) {
+      const LogBlockHeader &Header = Blocks[i].Header;
+      Compressed.resize(Header.CompressedSize);
+      vector<char> *Raw = new vector<char>(Header.RawSize);
+      fseeko(Blocks[i].LogFile, Blocks[i].Offset + sizeof Header, SEEK_SET);
+      if (fread(&Compressed[0], Compressed.size(), 1, Blocks[i].LogFile) != 1 ||
+          !decompress(Compressed, *Raw)) {
+        delete Raw;
+        break;
+      }
+      pthread_mutex_lock(&Mutex);
+      while (Ready.size() >= MaxNumReady && !Stopping)
+        pthread_cond_wait(&Cond, &Mutex);
+      bool Stopped = Stopping;
+      if (!Stopped) {
+        Ready.push_back(Raw);
+        pthread_cond_broadcast(&Cond);
+      }
+      pthread_mutex_unlock(&Mutex);
+      if (Stopped) {
+        delete Raw;
+        break;
+      }
+    }
+    pthread_mutex_lock(&Mutex);
+    Done = true;
+    pthread_cond_broadcast(&Cond);
+    pthread_mutex_unlock(&Mutex);
+  }
+
+  static bool decompress(const vector<char> &Compressed, vector<char> &Raw) {
+#ifdef NG_HAVE_ZSTD
+    size_t Size = ZSTD_decompress(&Raw[0], Raw.size(),
+                                  &Compressed[0], Compressed.size());
+    return !ZSTD_isError(Size) && Size == Raw.size();
+#else
+    return false;
+#endif
+  }
+
+  const vector<BlockLocation> &Blocks;
+  pthread_t Thread;
+  pthread_mutex_t Mutex;
+  pthread_cond_t Cond;
+  deque<vector<char> *> Ready;
+  bool Done, Stopping;
+};
+
+// Locates the blocks of a compressed log. The scan of a range stops at
+// padding or at a truncated block. The bytes after the last block of a
+// segment but the last count as the block's padding. Returns the number of
+// the other bytes after the last block of each range.
+uint64_t LocateBlocks(const vector<LogRange> &Ranges,
+                      vector<BlockLocation> &Blocks) {
+#ifndef NG_HAVE_ZSTD
+  errs() << "Processing compressed logs requires building with zstd\n";
+  assert(false);
+#endif
+  uint64_t NumBytesLeft = 0;
+  for (size_t i = 0; i < Ranges.size(); ++i) {
+    const LogRange &Range = Ranges[i];
+    off_t Offset = Range.Begin;
+    LogBlockHeader BlockHeader;
+    fseeko(Range.File, Offset, SEEK_SET);
+    while (Offset + (off_t)sizeof BlockHeader <= Range.End &&
+           fread(&BlockHeader, sizeof BlockHeader, 1, Range.File) == 1 &&
+           BlockHeader.CompressedSize > 0 && BlockHeader.RawSize > 0 &&
+           Offset + sizeof BlockHeader + BlockHeader.CompressedSize <=
+               (uint64_t)Range.End) {
+      Blocks.push_back(BlockLocation(Range.File, Range.Flags, Offset,
+                                     BlockHeader));
+      Offset += sizeof BlockHeader + BlockHeader.CompressedSize;
+      fseeko(Range.File, Offset, SEEK_SET);
+    }
+    if (Range.IsSegment && i + 1 < Ranges.size() && !Blocks.empty())
+      Blocks.back().Padding += Range.End - Offset;
+    else
+      NumBytesLeft += Range.End - Offset;
+  }
+  return NumBytesLeft;
+}
+
+// Decodes a block into <Records>, paired with their stamps.
+void DecodeBlock(const vector<char> &Raw, uint16_t Flags,
+                 vector<pair<LogRecord, uint64_t> > &Records) {
+  // Each block starts with a fresh codec state.
+  LogCodecState State = LogCodecState();
+  LogRecord Record;
+  uint64_t Stamp;
+  Records.clear();
+  for (size_t Begin = 0, Size; Begin < Raw.size(); Begin += Size) {
+    Size = LogFormat::Decode(&Raw[0] + Begin, Raw.size() - Begin, Record,
+                             Stamp, Flags, State);
+    if (Size == 0)
+      break;
+    Records.push_back(make_pair(Record, Stamp));
+  }
+}
+
+// Decodes the records of a versioned log, i.e. all its ranges, in the forward
+// direction.
+struct LogReader {
+  virtual ~LogReader() {}
+  // Reads the next record and its stamp. <Size> is the number of bytes in
+  // the log that the record accounts for. Returns false at the end.
+  virtual bool next(LogRecord &Record, uint64_t &Stamp, size_t &Size) = 0;
+};
+
+struct RangeReader: public LogReader {
+  RangeReader(const vector<LogRange> &Ranges):
+      Ranges(Ranges), CurrentRange(0), Reader(NULL), State(), Padding(0) {}
+
+  ~RangeReader() {
+    delete Reader;
+  }
+
+  bool next(LogRecord &Record, uint64_t &Stamp, size_t &Size) {
+    while (true) {
+      if (!Reader) {
+        if (CurrentRange == Ranges.size())
+          return false;
+        const LogRange &Range = Ranges[CurrentRange];
+        // Delta-encoded records of a forked child's unsegmented log continue
+        // from the codec state at the end of its parent's range.
+        if (Range.IsSegment)
+          State = LogCodecState();
+        Reader = new RecordReader(Range.File, Range.Flags, Range.Begin,
+                                  Range.End, State);
+      }
+      off_t Offset = Reader->tell();
+      if (Reader->next(Record, Stamp)) {
+        // The next record accounts for the padding before it.
+        Size = Reader->tell() - Offset + Padding;
+        Padding = 0;
+        return true;
+      }
+      const LogRange &Range = Ranges[CurrentRange];
+      if (Range.IsSegment && CurrentRange + 1 < Ranges.size())
+        Padding += Range.End - Reader->tell();
+      State = Reader->getState();
+      delete Reader;
+      Reader = NULL;
+      ++CurrentRange;
+    }
+  }
+
+ private:
+  const vector<LogRange> &Ranges;
+  size_t CurrentRange;
+  RecordReader *Reader;
+  LogCodecState State;
+  // The padding at the end of the segments read so far.
+  uint64_t Padding;
+};
+
+struct BlockReader: public LogReader {
+  BlockReader(const vector<LogRange> &Ranges):
+      CurrentBlock(0), CurrentRecord(0) {
+    LocateBlocks(Ranges, Blocks);
+    Prefetcher = new BlockPrefetcher(Blocks);
+  }
+
+  ~BlockReader() {
+    delete Prefetcher;
+  }
+
+  bool next(LogRecord &Record, uint64_t &Stamp, size_t &Size) {
+    Size = 0;
+    while (CurrentRecord == Records.size()) {
+      if (!Prefetcher->next(Raw))
+        return false;
+      DecodeBlock(Raw, Blocks[CurrentBlock].Flags, Records);
+      // Records in a block share its bytes, so the first record accounts for
+      // the whole block.
+      Size += Blocks[CurrentBlock].getSize();
+      ++CurrentBlock;
+      CurrentRecord = 0;
+    }
+    Record = Records[CurrentRecord].first;
+    Stamp = Records[CurrentRecord].second;
+    ++CurrentRecord;
+    return true;
+  }
+
+ private:
+  vector<BlockLocation> Blocks;
+  BlockPrefetcher *Prefetcher;
+  size_t CurrentBlock;
+  vector<char> Raw;
+  vector<pair<LogRecord, uint64_t> > Records;
+  size_t CurrentRecord;
+};
+
+LogReader *CreateLogReader(const vector<LogRange> &Ranges) {
+  if (Ranges[0].Flags & LogFormat::Compressed)
+    return new BlockReader(Ranges);
+  return new RangeReader(Ranges);
+}
+
+// The next record of a log being merged.
+struct StampedRecord {
+  StampedRecord(uint64_t Stamp, unsigned LogID, const LogRecord &Record,
+                size_t Size):
+      Stamp(Stamp), LogID(LogID), Record(Record), Size(Size) {}
+
+  // Reversed, so that a priority_queue pops the earliest record.
+  bool operator<(const StampedRecord &Other) const {
+    if (Stamp != Other.Stamp)
+      return Stamp > Other.Stamp;
+    return LogID > Other.LogID;
+  }
+
+  uint64_t Stamp;
+  unsigned LogID;
+  LogRecord Record;
+  size_t Size;
+};
+
+// The analyzer's side of a stream slot.
+struct StreamReader {
+  StreamReader(): HeaderRead(false), Flags(0), State() {}
+
+  // Moves the bytes the producer of <Slot> has published so far from <Ring>
+  // to Pending. Returns whether there were any.
+  bool drain(LogStreamSlot *Slot, const char *Ring, uint64_t Capacity) {
+    uint64_t Head = Slot->Head;
+    // Read the published bytes only after reading Head.
+    __sync_synchronize();
+    uint64_t Tail = Slot->Tail;
+    if (Head == Tail)
+      return false;
+    size_t Offset = Tail & (Capacity - 1);
+    size_t Length = Head - Tail;
+    size_t FirstPart = min<uint64_t>(Length, Capacity - Offset);
+    Pending.insert(Pending.end(), Ring + Offset, Ring + Offset + FirstPart);
+    Pending.insert(Pending.end(), Ring, Ring + (Length - FirstPart));
+    // Finish reading the bytes before handing the space back to the producer.
+    __sync_synchronize();
+    Slot->Tail = Head;
+    return true;
+  }
+
+  // Bytes drained but not decoded yet, e.g. the head of a record whose tail
+  // is not published yet.
+  vector<char> Pending;
+  // Set after the LogFileHeader and the LogSegmentHeader are consumed.
+  bool HeaderRead;
+  uint16_t Flags;
+  LogCodecState State;
+};
+}
+
 void LogProcessor::processLog(bool Reversed) {
+  loadDerivations();
+  if (LogShm != "") {
+    assert(!Reversed && "Streamed records can only be processed forward.");
+    processStream();
+    return;
+  }
   assert(LogFileNames.size() && "Didn't specify the log file.");
+  if (MergeLogs) {
+    assert(!Reversed && "Merged logs can only be processed forward.");
+    processMergedLogs();
+    return;
+  }
   for (unsigned i = 0; i < LogFileNames.size(); i++) {
+    CurrentLogID = i;
     processLog(LogFileNames[i], Reversed);
   }
 }
@@ -47,60 +493,290 @@ void LogProcessor::processLog(const std::string &LogFileName, bool Reversed) {
   errs() << "Processing log " << LogFileName << " ...\n";
   errs().resetColor();
 
-  if (Reversed) {
-    // Set the file position to the end.
-    fseek(LogFile, 0, SEEK_END);
+  initialize();
+  CallStacks.clear();
+
+  FileSize = GetFileSize(LogFile);
+  NumBytesRead = 0;
+  NumRecords = 0;
+  CurrentRecordID = 0;
+  DynAAUtils::PrintProgressBar(0, NumBytesRead, FileSize);
+
+  LogFileHeader Header;
+  if (fread(&Header, sizeof Header, 1, LogFile) == 1 &&
+      LogFormat::IsValidHeader(Header)) {
+    vector<LogRange> Ranges;
+    openLogRanges(LogFileName, FileSize, Ranges);
+    // Count the ranges of the parents' logs as well, but not the headers.
+    FileSize = 0;
+    NumBytesRead = 0;
+    for (size_t i = 0; i < Ranges.size(); ++i) {
+      assert((Ranges[i].Flags & LogFormat::Compressed) ==
+             (Header.Flags & LogFormat::Compressed));
+      FileSize += Ranges[i].End - Ranges[i].Begin;
+    }
+    if (FileSize == 0) {
+      // DynAAUtils::PrintProgressBar needs a positive total.
+      FileSize = 1;
+      NumBytesRead = 1;
+    }
+    if (!Reversed) {
+      // Skip the segments before StartRecordID without reading them.
+      size_t FirstRange = 0;
+      while (FirstRange + 1 < Ranges.size() &&
+             Ranges[FirstRange + 1].IsSegment &&
+             Ranges[FirstRange + 1].FirstRecordID <= StartRecordID) {
+        NumBytesRead += Ranges[FirstRange].End - Ranges[FirstRange].Begin;
+        ++FirstRange;
+      }
+      vector<LogRange> RangesLeft(Ranges.begin() + FirstRange, Ranges.end());
+      uint64_t RecordID = RangesLeft.empty() ? 0 :
+          RangesLeft[0].FirstRecordID;
+      LogReader *Reader = CreateLogReader(RangesLeft);
+      LogRecord Record;
+      uint64_t Stamp;
+      size_t Size;
+      while (Reader->next(Record, Stamp, Size)) {
+        if (RecordID++ >= StartRecordID) {
+          processRecord(Record, Size);
+          continue;
+        }
+        // Skipped records still define the frame layouts.
+        NumBytesRead += Size;
+        if (Record.RecordType == LogRecord::FrameSlot)
+          addFrameSlot(Record.FSR);
+      }
+      delete Reader;
+    } else if (Header.Flags & LogFormat::Compressed) {
+      ReversedOrder = true;
+      processReversedCompressedLog(Ranges);
+    } else {
+      ReversedOrder = true;
+      processReversedLog(Ranges);
+    }
+    ReversedOrder = false;
+    CloseLogRanges(Ranges);
+  } else {
+    processLegacyLog(LogFile, Reversed);
   }
+  errs() << "\n";
+
+  checkNumBytesRead();
+
+  finalize();
+
+  fclose(LogFile);
+}
+
+void LogProcessor::processMergedLogs() {
+  errs().changeColor(raw_ostream::BLUE);
+  errs() << "Merging " << LogFileNames.size() << " logs ...\n";
+  errs().resetColor();
 
   initialize();
+  CallStacks.clear();
 
-  uint64_t FileSize = GetFileSize(LogFile);
-  uint64_t NumBytesRead = 0;
+  vector<vector<LogRange> > Ranges(LogFileNames.size());
+  vector<LogReader *> Readers(LogFileNames.size());
+  FileSize = 0;
+  NumBytesRead = 0;
   NumRecords = 0;
   CurrentRecordID = 0;
+  for (unsigned i = 0; i < LogFileNames.size(); ++i) {
+    FILE *LogFile = fopen(LogFileNames[i].c_str(), "rb");
+    assert(LogFile && "The log file doesn't exist.");
+    openLogRanges(LogFileNames[i], GetFileSize(LogFile), Ranges[i]);
+    fclose(LogFile);
+    if (!(Ranges[i].back().Flags & LogFormat::Stamped)) {
+      errs() << LogFileNames[i] << " has no stamps to merge by\n";
+      assert(false);
+    }
+    for (size_t j = 0; j < Ranges[i].size(); ++j)
+      FileSize += Ranges[i][j].End - Ranges[i][j].Begin;
+    Readers[i] = CreateLogReader(Ranges[i]);
+  }
+  if (FileSize == 0) {
+    FileSize = 1;
+    NumBytesRead = 1;
+  }
   DynAAUtils::PrintProgressBar(0, NumBytesRead, FileSize);
+
+  // Holds the next record of each log.
+  priority_queue<StampedRecord> NextRecords;
   LogRecord Record;
-  while (ReadData(&Record, sizeof Record, Reversed, LogFile)) {
-    uint64_t OldNumBytesRead = NumBytesRead;
-    ++NumRecords;
-    NumBytesRead += sizeof Record;
-    beforeRecord(Record);
-    switch (Record.RecordType) {
-      case LogRecord::MemAlloc:
-        processMemAlloc(Record.MAR);
-        ++NumMemAllocRecords;
-        break;
-      case LogRecord::TopLevel:
-        processTopLevel(Record.TLR);
-        ++NumTopLevelRecords;
-        break;
-      case LogRecord::Enter:
-        processEnter(Record.ER);
-        ++NumEnterRecords;
-        break;
-      case LogRecord::Store:
-        processStore(Record.SR);
-        ++NumStoreRecords;
-        break;
-      case LogRecord::Call:
-        processCall(Record.CR);
-        ++NumCallRecords;
-        break;
-      case LogRecord::Return:
-        processReturn(Record.RR);
-        ++NumReturnRecords;
-        break;
-      case LogRecord::BasicBlock:
-        processBasicBlock(Record.BBR);
-        ++NumBasicBlockRecords;
-        break;
-    }
-    afterRecord(Record);
-    ++CurrentRecordID;
-    DynAAUtils::PrintProgressBar(OldNumBytesRead, NumBytesRead, FileSize);
+  uint64_t Stamp;
+  size_t Size;
+  for (unsigned i = 0; i < Readers.size(); ++i) {
+    if (Readers[i]->next(Record, Stamp, Size))
+      NextRecords.push(StampedRecord(Stamp, i, Record, Size));
+  }
+  while (!NextRecords.empty()) {
+    StampedRecord Next = NextRecords.top();
+    NextRecords.pop();
+    CurrentLogID = Next.LogID;
+    processRecord(Next.Record, Next.Size);
+    if (Readers[Next.LogID]->next(Record, Stamp, Size))
+      NextRecords.push(StampedRecord(Stamp, Next.LogID, Record, Size));
   }
   errs() << "\n";
 
+  checkNumBytesRead();
+
+  finalize();
+
+  for (unsigned i = 0; i < Readers.size(); ++i) {
+    delete Readers[i];
+    CloseLogRanges(Ranges[i]);
+  }
+}
+
+void LogProcessor::processStream() {
+  uint64_t RingCapacity;
+  for (RingCapacity = 4096; RingCapacity < LogShmRingSize; RingCapacity *= 2);
+  size_t AreaSize = LogStream::GetAreaSize(LogShmSlots, RingCapacity);
+  // Start afresh if an earlier analyzer didn't clean up.
+  shm_unlink(LogShm.c_str());
+  int FD = shm_open(LogShm.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (FD == -1 || ftruncate(FD, AreaSize) == -1) {
+    errs() << "Cannot create " << LogShm << "\n";
+    assert(false);
+  }
+  // ftruncate zero-fills the area.
+  void *Memory = mmap(NULL, AreaSize, PROT_READ | PROT_WRITE, MAP_SHARED, FD,
+                      0);
+  assert(Memory != MAP_FAILED && "Cannot map the stream area.");
+  close(FD);
+  LogStreamArea *Area = (LogStreamArea *)Memory;
+  LogStream::InitArea(Area, LogShmSlots, RingCapacity);
+
+  errs().changeColor(raw_ostream::BLUE);
+  errs() << "Processing records streamed through " << LogShm << " ...\n";
+  errs().resetColor();
+
+  initialize();
+  CallStacks.clear();
+
+  // The size of a stream is unknown, so the progress bar stays at 0%.
+  FileSize = (uint64_t)-1;
+  NumBytesRead = 0;
+  NumRecords = 0;
+  CurrentRecordID = 0;
+
+  vector<StreamReader> Readers(LogShmSlots);
+  // The process streaming the records. A forked child's stream would need
+  // its own call stacks and address versions seeded from its parent's.
+  uint32_t ProducerID = 0;
+  bool Started = false, CaughtUp = true;
+  while (true) {
+    // Only producers add producers, so no stream starts after they are
+    // all gone.
+    int32_t NumProducers = Area->NumProducers;
+    __sync_synchronize();
+    uint32_t NumSlots = Area->NumClaimedSlots;
+    NumSlots = min(NumSlots, Area->NumSlots);
+    bool Progressed = false, AllClosed = true, AnyProducerAlive = false;
+    for (uint32_t i = 0; i < NumSlots; ++i) {
+      LogStreamSlot *Slot = LogStream::GetSlot(Area, i);
+      uint32_t State = Slot->State;
+      if (State == LogStreamSlot::Free) {
+        // Claimed but not published yet.
+        AllClosed = false;
+        AnyProducerAlive = true;
+        continue;
+      }
+      // The bytes published before closing are drained below.
+      __sync_synchronize();
+      if (State == LogStreamSlot::Open) {
+        AllClosed = false;
+        if (kill(Slot->ProcessID, 0) == 0 || errno != ESRCH)
+          AnyProducerAlive = true;
+      }
+      StreamReader &Reader = Readers[i];
+      if (!Reader.drain(Slot, LogStream::GetRing(Area, i),
+                        Area->RingCapacity))
+        continue;
+      Progressed = true;
+
+      string StreamName = (Twine(LogShm) + ":" + Twine(i)).str();
+      const char *P = Reader.Pending.data();
+      const char *End = P + Reader.Pending.size();
+      if (!Reader.HeaderRead) {
+        LogFileHeader Header;
+        LogSegmentHeader SegmentHeader;
+        if (End - P < (ptrdiff_t)(sizeof Header + sizeof SegmentHeader))
+          continue;
+        memcpy(&Header, P, sizeof Header);
+        memcpy(&SegmentHeader, P + sizeof Header, sizeof SegmentHeader);
+        if (!LogFormat::IsValidHeader(Header) ||
+            Header.Version != LogFormat::CurrentVersion ||
+            (Header.Flags & (LogFormat::Compressed | LogFormat::Forked)) ||
+            !LogFormat::IsValidSegmentHeader(SegmentHeader)) {
+          errs() << StreamName << " is not a stream of records\n";
+          assert(false);
+        }
+        checkSegmentHeader(StreamName, SegmentHeader);
+        if (ProducerID == 0)
+          ProducerID = Slot->ProcessID;
+        if (Slot->ProcessID != ProducerID) {
+          errs() << StreamName << " comes from process " << Slot->ProcessID
+              << " instead of " << ProducerID
+              << ". Programs that fork cannot stream their records\n";
+          assert(false);
+        }
+        Reader.Flags = Header.Flags;
+        Reader.HeaderRead = true;
+        P += sizeof Header + sizeof SegmentHeader;
+      }
+      CurrentLogID = i;
+      LogRecord Record;
+      uint64_t Stamp;
+      while (size_t Size = LogFormat::Decode(P, End - P, Record, Stamp,
+                                             Reader.Flags, Reader.State)) {
+        processRecord(Record, Size);
+        P += Size;
+      }
+      assert(End - P < (ptrdiff_t)LogFormat::MaxEncodedSize &&
+             "The stream is broken.");
+      Reader.Pending.erase(Reader.Pending.begin(),
+                           Reader.Pending.begin() +
+                           (P - Reader.Pending.data()));
+    }
+    if (NumSlots > 0 || NumProducers > 0)
+      Started = true;
+    if (Progressed) {
+      CaughtUp = false;
+      continue;
+    }
+    if (!CaughtUp) {
+      afterCatchingUp();
+      CaughtUp = true;
+    }
+    if (Started && NumProducers <= 0 && AllClosed)
+      break;
+    // Open streams of dead processes never close.
+    if (!AllClosed && !AnyProducerAlive) {
+      errs().changeColor(raw_ostream::RED);
+      errs() << "The instrumented program exited without closing its "
+          "streams. Processed as many records as possible.\n";
+      errs().resetColor();
+      break;
+    }
+    struct timespec Duration = {0, 1000 * 1000};
+    nanosleep(&Duration, NULL);
+  }
+  for (uint32_t i = 0; i < Readers.size(); ++i) {
+    if (!Readers[i].Pending.empty()) {
+      errs() << LogShm << ":" << i << " ends with a truncated record\n";
+    }
+  }
+
+  finalize();
+
+  munmap(Memory, AreaSize);
+  shm_unlink(LogShm.c_str());
+}
+
+void LogProcessor::checkNumBytesRead() {
   assert(NumBytesRead <= FileSize);
   if (NumBytesRead < FileSize) {
     errs().changeColor(raw_ostream::RED);
@@ -109,10 +785,458 @@ void LogProcessor::processLog(const std::string &LogFileName, bool Reversed) {
     errs() << "Try to process as much log as possible.\n";
     errs().resetColor();
   }
+}
 
-  finalize();
+void LogProcessor::processLegacyLog(FILE *LogFile, bool Reversed) {
+  uint64_t End = FileSize;
+  if (Reversed) {
+    // Set the file position to the end of the last whole record. Skip the
+    // zero padding the mmap writer leaves behind if the program crashed.
+    End = FileSize / sizeof(LogRecord) * sizeof(LogRecord);
+    fseeko(LogFile, End, SEEK_SET);
+    LogRecord Record;
+    while (ReadData(&Record, sizeof Record, Reversed, LogFile) &&
+           IsPadding(Record)) {
+      End = ftello(LogFile);
+    }
+    fseeko(LogFile, End, SEEK_SET);
+  } else {
+    fseeko(LogFile, 0, SEEK_SET);
+  }
+  // Bytes skipped as padding count as read.
+  NumBytesRead = FileSize - End;
 
-  fclose(LogFile);
+  LogRecord Record;
+  while (ReadData(&Record, sizeof Record, Reversed, LogFile)) {
+    // The rest of the file is the zero padding left by the mmap writer.
+    if (IsPadding(Record))
+      break;
+    processRecord(Record, sizeof Record);
+  }
+}
+
+void LogProcessor::openLogRanges(const string &LogFileName, off_t End,
+                                 vector<LogRange> &Ranges) {
+  FILE *LogFile = fopen(LogFileName.c_str(), "rb");
+  if (!LogFile) {
+    errs() << "Cannot open log " << LogFileName << "\n";
+    assert(false);
+  }
+  LogFileHeader Header;
+  if (fread(&Header, sizeof Header, 1, LogFile) != 1 ||
+      !LogFormat::IsValidHeader(Header)) {
+    errs() << LogFileName << " has no log header\n";
+    assert(false);
+  }
+  if (Header.Version == 0 || Header.Version > LogFormat::CurrentVersion) {
+    errs() << "Unsupported log version " << Header.Version << "\n";
+    assert(false);
+  }
+
+  off_t Begin = sizeof Header;
+  if (Header.Flags & LogFormat::Forked) {
+    LogParentRef Ref;
+    bool Valid = (fread(&Ref, sizeof Ref, 1, LogFile) == 1 &&
+                  Ref.NameLength > 0);
+    string ParentLogName(Valid ? Ref.NameLength : 0, '\0');
+    Valid = Valid &&
+        fread(&ParentLogName[0], Ref.NameLength, 1, LogFile) == 1;
+    assert(Valid && "The reference to the parent's log is broken.");
+    Begin += sizeof Ref + Ref.NameLength;
+    // The parent's log is in the same directory.
+    size_t Slash = LogFileName.rfind('/');
+    if (Slash != string::npos)
+      ParentLogName = LogFileName.substr(0, Slash + 1) + ParentLogName;
+    openLogRanges(ParentLogName, Ref.ParentLogSize, Ranges);
+  }
+
+  if (Header.Version >= LogFormat::FirstSegmentedVersion) {
+    openLogSegments(LogFileName, LogFile, Header.Flags, Begin, End, Ranges);
+    return;
+  }
+  LogRange Range;
+  Range.File = LogFile;
+  Range.Flags = Header.Flags;
+  Range.Begin = Begin;
+  Range.End = max(Begin, min(End, GetFileSize(LogFile)));
+  Range.IsSegment = false;
+  Range.FirstRecordID = 0;
+  Ranges.push_back(Range);
+}
+
+void LogProcessor::openLogSegments(const string &LogFileName, FILE *LogFile,
+                                   uint16_t Flags, off_t Begin, off_t End,
+                                   vector<LogRange> &Ranges) {
+  // Read the index at the end of the log, if the log was closed.
+  off_t FileSize = GetFileSize(LogFile);
+  off_t DataEnd = FileSize;
+  vector<LogSegmentIndexEntry> Index;
+  LogIndexTrailer Trailer;
+  if (FileSize >= Begin + (off_t)sizeof Trailer &&
+      fseeko(LogFile, FileSize - sizeof Trailer, SEEK_SET) == 0 &&
+      fread(&Trailer, sizeof Trailer, 1, LogFile) == 1 &&
+      LogFormat::IsValidIndexTrailer(Trailer) &&
+      Trailer.NumSegments <= (FileSize - Begin - sizeof Trailer) /
+          sizeof(LogSegmentIndexEntry)) {
+    DataEnd = FileSize - sizeof Trailer -
+        Trailer.NumSegments * sizeof(LogSegmentIndexEntry);
+    Index.resize(Trailer.NumSegments);
+    fseeko(LogFile, DataEnd, SEEK_SET);
+    if (!Index.empty() &&
+        fread(&Index[0], sizeof(LogSegmentIndexEntry), Index.size(),
+              LogFile) != Index.size()) {
+      errs() << LogFileName << " has a broken segment index\n";
+      assert(false);
+    }
+  } else {
+    errs().changeColor(raw_ostream::RED);
+    errs() << LogFileName << " has no segment index, probably because "
+        "the instrumented program did not exit normally.\n";
+    errs().resetColor();
+  }
+
+  // Segments are at fixed strides, so they can be located without the index
+  // as well.
+  End = min(End, DataEnd);
+  off_t Offset = Begin;
+  for (size_t i = 0; Offset + (off_t)sizeof(LogSegmentHeader) <= End; ++i) {
+    LogSegmentHeader Header;
+    fseeko(LogFile, Offset, SEEK_SET);
+    if (fread(&Header, sizeof Header, 1, LogFile) != 1 ||
+        !LogFormat::IsValidSegmentHeader(Header)) {
+      errs() << LogFileName << " has a broken segment at offset " << Offset
+          << "\n";
+      assert(false);
+    }
+    if (i < Index.size() && (Index[i].Offset != (uint64_t)Offset ||
+                             Index[i].FirstRecordID != Header.FirstRecordID)) {
+      errs() << LogFileName << " has a broken segment index\n";
+      assert(false);
+    }
+    checkSegmentHeader(LogFileName, Header);
+    LogRange Range;
+    Range.File = LogFile;
+    Range.Flags = Flags;
+    Range.Begin = Offset + sizeof Header;
+    Range.End = min(End, (off_t)(Offset + Header.Capacity));
+    Range.IsSegment = true;
+    Range.FirstRecordID = Header.FirstRecordID;
+    Ranges.push_back(Range);
+    Offset += Header.Capacity;
+  }
+}
+
+void LogProcessor::checkSegmentHeader(const string &LogName,
+                                      const LogSegmentHeader &Header) const {
+  if (Header.PointerSize != sizeof(void *)) {
+    errs() << LogName << " is written by a program with "
+        << (unsigned)Header.PointerSize << "-byte pointers\n";
+    assert(false);
+  }
+  if (ModuleHash != 0 && Header.ModuleHash != 0 &&
+      Header.ModuleHash != ModuleHash) {
+    errs() << LogName << " is written by a program instrumented from "
+        "a different module\n";
+    assert(false);
+  }
+}
+
+void LogProcessor::CloseLogRanges(const vector<LogRange> &Ranges) {
+  // Segments of the same log share the file.
+  set<FILE *> Files;
+  for (size_t i = 0; i < Ranges.size(); ++i) {
+    if (Files.insert(Ranges[i].File).second)
+      fclose(Ranges[i].File);
+  }
+}
+
+void LogProcessor::processReversedLog(const vector<LogRange> &Ranges) {
+  // Records have different sizes, so they cannot be read backwards directly.
+  // Instead, we remember the offset of every CheckpointInterval-th record in a
+  // forward pass, and then decode the records between two consecutive
+  // checkpoints at a time from the last checkpoint to the first. A checkpoint
+  // also saves the codec state, which delta-encoded records depend on.
+  const unsigned CheckpointInterval = 65536;
+  vector<Checkpoint> Checkpoints;
+  // Delta-encoded records of a forked child continue from the codec state at
+  // the end of its parent's range.
+  LogCodecState State = LogCodecState();
+  for (size_t i = 0; i < Ranges.size(); ++i) {
+    const LogRange &Range = Ranges[i];
+    if (Range.IsSegment)
+      State = LogCodecState();
+    RecordReader Reader(Range.File, Range.Flags, Range.Begin, Range.End,
+                        State);
+    LogRecord Record;
+    uint64_t Stamp;
+    unsigned NumRecordsRead = 0;
+    do {
+      if (NumRecordsRead % CheckpointInterval == 0)
+        Checkpoints.push_back(Checkpoint(i, Reader.tell(), Reader.getState()));
+      // The forward pass also collects frame layouts, which precede their
+      // uses in the log.
+      if (NumRecordsRead > 0 && Record.RecordType == LogRecord::FrameSlot)
+        addFrameSlot(Record.FSR);
+      ++NumRecordsRead;
+    } while (Reader.next(Record, Stamp));
+    // The data after the last record is either padding or broken.
+    NumBytesRead += Range.End - Reader.tell();
+    State = Reader.getState();
+  }
+
+  vector<pair<LogRecord, size_t> > Records;
+  for (size_t i = Checkpoints.size(); i > 0; --i) {
+    const Checkpoint &C = Checkpoints[i - 1];
+    const LogRange &Range = Ranges[C.RangeID];
+    RecordReader Reader(Range.File, Range.Flags, C.Offset, Range.End, C.State);
+    Records.clear();
+    LogRecord Record;
+    uint64_t Stamp;
+    off_t Offset = Reader.tell();
+    while (Records.size() < CheckpointInterval && Reader.next(Record, Stamp)) {
+      Records.push_back(make_pair(Record, Reader.tell() - Offset));
+      Offset = Reader.tell();
+    }
+    for (size_t j = Records.size(); j > 0; --j)
+      processRecord(Records[j - 1].first, Records[j - 1].second);
+  }
+}
+
+void LogProcessor::processReversedCompressedLog(
+    const vector<LogRange> &Ranges) {
+  // Frame layouts precede their uses in the log, so collect them in a forward
+  // pass first.
+  LogReader *Reader = CreateLogReader(Ranges);
+  LogRecord Record;
+  uint64_t Stamp;
+  size_t Size;
+  while (Reader->next(Record, Stamp, Size)) {
+    if (Record.RecordType == LogRecord::FrameSlot)
+      addFrameSlot(Record.FSR);
+  }
+  delete Reader;
+
+  vector<BlockLocation> Blocks;
+  // The data after the last block is either padding or broken.
+  NumBytesRead += LocateBlocks(Ranges, Blocks);
+  reverse(Blocks.begin(), Blocks.end());
+
+  BlockPrefetcher Prefetcher(Blocks);
+  vector<char> Raw;
+  vector<pair<LogRecord, uint64_t> > Records;
+  for (size_t i = 0; Prefetcher.next(Raw); ++i) {
+    DecodeBlock(Raw, Blocks[i].Flags, Records);
+    for (size_t j = Records.size(); j > 0; --j)
+      processRecord(Records[j - 1].first, 0);
+    // Records in a block share its bytes, so the progress bar moves a block
+    // at a time.
+    uint64_t OldNumBytesRead = NumBytesRead;
+    NumBytesRead += Blocks[i].getSize();
+    DynAAUtils::PrintProgressBar(OldNumBytesRead, NumBytesRead, FileSize);
+  }
+}
+
+void LogProcessor::processRecord(const LogRecord &Record, size_t Size) {
+  uint64_t OldNumBytesRead = NumBytesRead;
+  NumBytesRead += Size;
+  if (Record.RecordType == LogRecord::FrameSlot) {
+    // The reversed passes collect frame layouts beforehand.
+    if (!ReversedOrder)
+      addFrameSlot(Record.FSR);
+  } else if (Record.RecordType == LogRecord::FrameAlloc) {
+    expandFrameAlloc(Record.FAR);
+  } else if (Record.RecordType == LogRecord::GlobalAlloc) {
+    expandGlobalAlloc(Record.GAR);
+  } else if (Record.RecordType == LogRecord::TopLevel &&
+             !DerivedPointers.empty()) {
+    expandTopLevel(Record);
+  } else {
+    dispatchRecord(Record);
+  }
+  // Frames are released when their functions return. When processing
+  // backwards, a frame is not known when its function returns.
+  if (!ReversedOrder) {
+    vector<ActiveFrame> &CallStack = CallStacks[CurrentLogID];
+    if (Record.RecordType == LogRecord::Enter) {
+      ActiveFrame Frame;
+      Frame.FunctionID = Record.ER.FunctionID;
+      Frame.Base = NULL;
+      CallStack.push_back(Frame);
+    } else if (Record.RecordType == LogRecord::FrameAlloc) {
+      if (!CallStack.empty() &&
+          CallStack.back().FunctionID == Record.FAR.FunctionID)
+        CallStack.back().Base = Record.FAR.Base;
+    } else if (Record.RecordType == LogRecord::Return) {
+      releaseFrames(Record.RR.FunctionID);
+    }
+  }
+  DynAAUtils::PrintProgressBar(OldNumBytesRead, NumBytesRead, FileSize);
+}
+
+void LogProcessor::addFrameSlot(const FrameSlotRecord &Slot) {
+  vector<FrameSlotRecord> &Layout = FrameLayouts[Slot.FunctionID];
+  // Each log has its own copy of the layout, and a forked child's log replays
+  // its parent's.
+  if (Slot.Index == 0)
+    Layout.clear();
+  assert(Slot.Index == Layout.size());
+  Layout.push_back(Slot);
+}
+
+void LogProcessor::expandFrameAlloc(const FrameAllocRecord &Frame) {
+  map<unsigned, vector<FrameSlotRecord> >::const_iterator I =
+      FrameLayouts.find(Frame.FunctionID);
+  // Each segment logs the layouts its frames need, so skipping segments
+  // loses none.
+  assert(I != FrameLayouts.end() && "The frame layout is not logged.");
+  const vector<FrameSlotRecord> &Layout = I->second;
+  for (size_t i = 0; i < Layout.size(); ++i) {
+    const FrameSlotRecord &Slot =
+        Layout[ReversedOrder ? Layout.size() - 1 - i : i];
+    LogRecord Record;
+    Record.RecordType = LogRecord::MemAlloc;
+    Record.MAR.Address = (char *)Frame.Base + Slot.Offset;
+    Record.MAR.Bound = Slot.Bound;
+    Record.MAR.AllocatedBy = Slot.AllocatedBy;
+    dispatchRecord(Record);
+  }
+}
+
+void LogProcessor::expandGlobalAlloc(const GlobalAllocRecord &Global) {
+  LogRecord Alloc;
+  Alloc.RecordType = LogRecord::MemAlloc;
+  Alloc.MAR.Address = Global.Address;
+  Alloc.MAR.Bound = Global.Bound;
+  Alloc.MAR.AllocatedBy = Global.ValueID;
+  LogRecord Pointer;
+  Pointer.RecordType = LogRecord::TopLevel;
+  Pointer.TLR.PointerValueID = Global.ValueID;
+  Pointer.TLR.PointeeAddress = Global.Address;
+  Pointer.TLR.LoadedFrom = NULL;
+  // The pointer is defined after the global is allocated. Like HookMemAlloc,
+  // an empty global allocates nothing.
+  if (!ReversedOrder && Global.Bound > 0)
+    dispatchRecord(Alloc);
+  dispatchRecord(Pointer);
+  if (ReversedOrder && Global.Bound > 0)
+    dispatchRecord(Alloc);
+}
+
+void LogProcessor::expandTopLevel(const LogRecord &Base) {
+  map<unsigned, vector<DerivedPointer> >::const_iterator I =
+      DerivedPointers.find(Base.TLR.PointerValueID);
+  if (I == DerivedPointers.end()) {
+    dispatchRecord(Base);
+    return;
+  }
+  // The derived pointers are computed after the base.
+  if (!ReversedOrder)
+    dispatchRecord(Base);
+  const vector<DerivedPointer> &Derived = I->second;
+  for (size_t i = 0; i < Derived.size(); ++i) {
+    const DerivedPointer &D =
+        Derived[ReversedOrder ? Derived.size() - 1 - i : i];
+    LogRecord Record;
+    Record.RecordType = LogRecord::TopLevel;
+    Record.TLR.PointerValueID = D.ValueID;
+    Record.TLR.PointeeAddress = (char *)Base.TLR.PointeeAddress + D.Offset;
+    Record.TLR.LoadedFrom = NULL;
+    dispatchRecord(Record);
+  }
+  if (ReversedOrder)
+    dispatchRecord(Base);
+}
+
+void LogProcessor::loadDerivations() {
+  if (Derivations == "" || !DerivedPointers.empty())
+    return;
+  FILE *DerivationsFile = fopen(Derivations.c_str(), "r");
+  assert(DerivationsFile && "The derivations file doesn't exist.");
+  unsigned ValueID, BaseID;
+  long long Offset;
+  while (fscanf(DerivationsFile, "%u %u %lld", &ValueID, &BaseID,
+                &Offset) == 3) {
+    DerivedPointer D;
+    D.ValueID = ValueID;
+    D.Offset = Offset;
+    DerivedPointers[BaseID].push_back(D);
+  }
+  fclose(DerivationsFile);
+  // Value IDs follow the order of instructions, and the pointers derived from
+  // a base are in the same basic block.
+  for (map<unsigned, vector<DerivedPointer> >::iterator
+       I = DerivedPointers.begin(); I != DerivedPointers.end(); ++I) {
+    std::sort(I->second.begin(), I->second.end());
+  }
+}
+
+void LogProcessor::releaseFrames(unsigned FunctionID) {
+  vector<ActiveFrame> &CallStack = CallStacks[CurrentLogID];
+  // longjmp may skip the returns of the invocations above.
+  size_t Depth = CallStack.size();
+  while (Depth > 0 && CallStack[Depth - 1].FunctionID != FunctionID)
+    --Depth;
+  if (Depth == 0)
+    return;
+  while (CallStack.size() >= Depth) {
+    const ActiveFrame &Frame = CallStack.back();
+    if (Frame.Base) {
+      const vector<FrameSlotRecord> &Layout = FrameLayouts[Frame.FunctionID];
+      for (size_t i = 0; i < Layout.size(); ++i) {
+        MemFreeRecord Slot;
+        Slot.Address = (char *)Frame.Base + Layout[i].Offset;
+        processMemFree(Slot);
+      }
+    }
+    CallStack.pop_back();
+  }
+}
+
+void LogProcessor::dispatchRecord(const LogRecord &Record) {
+  ++NumRecords;
+  beforeRecord(Record);
+  switch (Record.RecordType) {
+    case LogRecord::MemAlloc:
+      processMemAlloc(Record.MAR);
+      ++NumMemAllocRecords;
+      break;
+    case LogRecord::TopLevel:
+      processTopLevel(Record.TLR);
+      ++NumTopLevelRecords;
+      break;
+    case LogRecord::Enter:
+      processEnter(Record.ER);
+      ++NumEnterRecords;
+      break;
+    case LogRecord::Store:
+      processStore(Record.SR);
+      ++NumStoreRecords;
+      break;
+    case LogRecord::Call:
+      processCall(Record.CR);
+      ++NumCallRecords;
+      break;
+    case LogRecord::Return:
+      processReturn(Record.RR);
+      ++NumReturnRecords;
+      break;
+    case LogRecord::BasicBlock:
+      processBasicBlock(Record.BBR);
+      ++NumBasicBlockRecords;
+      break;
+    case LogRecord::MemFree:
+      processMemFree(Record.MFR);
+      ++NumMemFreeRecords;
+      break;
+    case LogRecord::FrameSlot:
+    case LogRecord::FrameAlloc:
+    case LogRecord::GlobalAlloc:
+      assert(false && "Frame and global records are handled by "
+             "processRecord.");
+      break;
+  }
+  afterRecord(Record);
+  ++CurrentRecordID;
 }
 
 bool LogProcessor::ReadData(void *P, int Length, bool Reversed, FILE *LogFile) {
@@ -130,6 +1254,17 @@ bool LogProcessor::ReadData(void *P, int Length, bool Reversed, FILE *LogFile) {
   return true;
 }
 
+bool LogProcessor::IsPadding(const LogRecord &Record) {
+  // HookMemAlloc never logs empty allocations, so a valid record is never all
+  // zeros.
+  const char *Bytes = (const char *)&Record;
+  for (size_t i = 0; i < sizeof Record; ++i) {
+    if (Bytes[i] != 0)
+      return false;
+  }
+  return true;
+}
+
 off_t LogProcessor::GetFileSize(FILE *LogFile) {
   int FD = fileno(LogFile);
   assert(FD != -1);
@@ -4,15 +4,19 @@
 #include "llvm/Argument.h"
 #include "llvm/Function.h"
 #include "llvm/Instructions.h"
+#include "llvm/Module.h"
 #include "llvm/Pass.h"
 #include "llvm/Type.h"
 #include "llvm/Support/CallSite.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include "rcs/IDAssigner.h"
+
 #include "dyn-aa/Utils.h"
 
 using namespace std;
 using namespace llvm;
+using namespace rcs;
 using namespace neongoby;
 
 const string DynAAUtils::MemAllocHookName = "HookMemAlloc";
@@ -23,11 +27,18 @@ const string DynAAUtils::StoreHookName = "HookStore";
 const string DynAAUtils::CallHookName = "HookCall";
 const string DynAAUtils::ReturnHookName = "HookReturn";
 const string DynAAUtils::GlobalsAllocHookName = "HookGlobalsAlloc";
+const string DynAAUtils::GlobalsAllocTableHookName = "HookGlobalsAllocTable";
 const string DynAAUtils::BasicBlockHookName = "HookBasicBlock";
 const string DynAAUtils::MemHooksIniterName = "InitMemHooks";
 const string DynAAUtils::AfterForkHookName = "HookAfterFork";
 const string DynAAUtils::BeforeForkHookName = "HookBeforeFork";
 const string DynAAUtils::VAStartHookName = "HookVAStart";
+const string DynAAUtils::FrameAllocHookName = "HookFrameAlloc";
+const string DynAAUtils::MemFreeHookName = "HookMemFree";
+const string DynAAUtils::TopLevelBatchHookName = "HookTopLevelBatch";
+const string DynAAUtils::TopLevelValueHookName = "HookTopLevelValue";
+const string DynAAUtils::TopLevelBatchNonNullHookName =
+    "HookTopLevelBatchNonNull";
 const string DynAAUtils::SlotsName = "ng.slots";
 
 void DynAAUtils::PrintProgressBar(uint64_t Old, uint64_t Now, uint64_t Total) {
@@ -133,6 +144,13 @@ bool DynAAUtils::IsMallocCall(const Value *V) {
   return IsMalloc(Callee);
 }
 
+bool DynAAUtils::IsFree(const Function *F) {
+  StringRef Name = F->getName();
+  return (Name == "free" ||
+          Name == "_ZdlPv" ||
+          Name == "_ZdaPv");
+}
+
 bool DynAAUtils::IsIntraProcQuery(const Value *V1, const Value *V2) {
   assert(V1->getType()->isPointerTy() && V2->getType()->isPointerTy());
   const Function *F1 = GetContainingFunction(V1);
@@ -155,3 +173,43 @@ const Function *DynAAUtils::GetContainingFunction(const Value *V) {
     return Arg->getParent();
   return NULL;
 }
+
+// FNV-1a.
+static void HashBytes(uint64_t &Hash, const void *Data, size_t Length) {
+  const unsigned char *Bytes = (const unsigned char *)Data;
+  for (size_t i = 0; i < Length; ++i) {
+    Hash ^= Bytes[i];
+    Hash *= 1099511628211ULL;
+  }
+}
+
+static void HashValue(uint64_t &Hash, unsigned ID, StringRef Name) {
+  HashBytes(Hash, &ID, sizeof ID);
+  HashBytes(Hash, Name.data(), Name.size());
+}
+
+uint64_t DynAAUtils::GetModuleHash(const Module &M, IDAssigner &IDA) {
+  uint64_t Hash = 14695981039346656037ULL;
+  // Values without IDs, e.g. those added by other instrumenters, are not part
+  // of the log's vocabulary.
+  for (Module::const_global_iterator GI = M.global_begin();
+       GI != M.global_end(); ++GI) {
+    unsigned ValueID = IDA.getValueID(GI);
+    if (ValueID != IDAssigner::InvalidID)
+      HashValue(Hash, ValueID, GI->getName());
+  }
+  for (Module::const_iterator F = M.begin(); F != M.end(); ++F) {
+    unsigned ValueID = IDA.getValueID(F);
+    if (ValueID == IDAssigner::InvalidID)
+      continue;
+    HashValue(Hash, ValueID, F->getName());
+    for (Function::const_iterator BB = F->begin(); BB != F->end(); ++BB) {
+      for (BasicBlock::const_iterator I = BB->begin(); I != BB->end(); ++I) {
+        unsigned InsID = IDA.getInstructionID(I);
+        if (InsID != IDAssigner::InvalidID)
+          HashBytes(Hash, &InsID, sizeof InsID);
+      }
+    }
+  }
+  return Hash == 0 ? 1 : Hash;
+}
@@ -4,24 +4,108 @@
 // the C++ name mangling and make the instrumentation easier.
 
 #include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
 
+#include <sys/stat.h>
+
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <queue>
 #include <sstream>
 #include <string>
+
+#include "dyn-aa/HookTelemetry.h"
+
 using namespace std;
+using namespace neongoby;
+
+// Indices of the telemetry counters.
+enum CheckerCounter {
+  // Calls to the checks that AliasCheckerInliner did not inline.
+  NumChecksCounter,
+  NumMissingAliasesCounter,
+  ReportCyclesCounter,
+  // Blocks put into and released from the DelayedFree quarantine, and the
+  // cycles spent there, including waiting for FreeLock.
+  NumQuarantinedCounter,
+  NumReleasedCounter,
+  QuarantineCyclesCounter,
+  NumCheckerCounters
+};
+static const char *const CheckerCounterNames[NumCheckerCounters] = {
+  "checks", "missing_aliases", "report_cycles",
+  "quarantined", "released", "quarantine_cycles"
+};
+typedef ThreadCounters<NumCheckerCounters> CheckerCounters;
+// Set by NG_TELEMETRY. The counters are dumped to
+// LOG_DIR/check-telemetry-<pid>, or /tmp/check-telemetry-<pid> without LOG_DIR,
+// at exit and on SIGUSR2.
+static bool TelemetryEnabled = false;
+static TelemetryRegistry<NumCheckerCounters> Telemetry(CheckerCounterNames);
+static __thread CheckerCounters *MyCounters = NULL;
+
+// Returns the current thread's counters, or NULL if telemetry is disabled.
+static inline CheckerCounters *GetMyCounters() {
+  if (!TelemetryEnabled)
+    return NULL;
+  if (!MyCounters)
+    MyCounters = Telemetry.registerThread();
+  return MyCounters;
+}
+
+static inline void Count(unsigned Counter, uint64_t N = 1) {
+  if (CheckerCounters *Counters = GetMyCounters())
+    Counters->Counts[Counter] += N;
+}
+
+// Returns the start of a timed section, which is 0 if telemetry is disabled.
+static inline uint64_t StartTiming() {
+  return TelemetryEnabled ? HookTelemetry::ReadCycleCounter() : 0;
+}
+
+static inline void StopTiming(unsigned Counter, uint64_t Start) {
+  if (Start)
+    Count(Counter, HookTelemetry::ReadCycleCounter() - Start);
+}
+
+// The SIGUSR2 action DumpTelemetry replaced, e.g. MemoryHooks'.
+static struct sigaction PreviousTelemetryAction;
+
+static void DumpTelemetry(int Signal, siginfo_t *Info, void *Context) {
+  Telemetry.dump();
+  HookTelemetry::ChainSignal(PreviousTelemetryAction, Signal, Info, Context);
+}
+
+static void SetTelemetryFileName() {
+  string Prefix = "/tmp";
+  if (const char *LogDirEnv = getenv("LOG_DIR")) {
+    Prefix = LogDirEnv;
+    // MemoryHooks may not have created it yet, or may not be linked in.
+    mkdir(Prefix.c_str(), 0755);
+  }
+  Telemetry.setFileName((Prefix + "/check-telemetry-").c_str(), getpid());
+}
 
 struct Environment {
   Environment(): ReportFile(NULL) {
     pthread_spin_init(&FreeLock, 0);
     pthread_mutex_init(&ReportLock, NULL);
     ReportFile = fopen(GetReportFileName().c_str(), "wb");
+    if (const char *TelemetryEnv = getenv("NG_TELEMETRY"))
+      TelemetryEnabled = (strcmp(TelemetryEnv, "0") != 0);
+    if (TelemetryEnabled) {
+      SetTelemetryFileName();
+      HookTelemetry::InstallSignalHandler(SIGUSR2, DumpTelemetry,
+                                          &PreviousTelemetryAction);
+    }
   }
 
   ~Environment() {
+    if (TelemetryEnabled)
+      Telemetry.dump();
     pthread_spin_destroy(&FreeLock);
     pthread_mutex_destroy(&ReportLock);
     assert(ReportFile);
@@ -54,6 +138,12 @@ extern "C" void OnlineAfterFork(int Result) {
   if (Result == 0) {
     // child process
     Global.ReportFile = fopen(Environment::GetReportFileName().c_str(), "wb");
+    // The child counts its own costs in its own telemetry file.
+    if (TelemetryEnabled) {
+      Telemetry.reset();
+      MyCounters = NULL;
+      SetTelemetryFileName();
+    }
   } else {
     // parent process
     Global.ReportFile = fopen(Environment::GetReportFileName().c_str(), "ab");
@@ -61,9 +151,12 @@ extern "C" void OnlineAfterFork(int Result) {
 }
 
 extern "C" void ReportMissingAlias(unsigned VIDOfP, unsigned VIDOfQ, void *V) {
+  uint64_t Start = StartTiming();
   pthread_mutex_lock(&Global.ReportLock);
   fprintf(Global.ReportFile, "Missing alias:\n[%u]\n[%u]\n", VIDOfP, VIDOfQ);
   pthread_mutex_unlock(&Global.ReportLock);
+  Count(NumMissingAliasesCounter);
+  StopTiming(ReportCyclesCounter, Start);
 }
 
 extern "C" void SilenceMissingAlias(unsigned VIDOfP, unsigned VIDOfQ, void *V) {
@@ -71,6 +164,7 @@ extern "C" void SilenceMissingAlias(unsigned VIDOfP, unsigned VIDOfQ, void *V) {
 
 extern "C" void AbortIfMissed(void *P, unsigned VIDOfP,
                               void *Q, unsigned VIDOfQ) {
+  Count(NumChecksCounter);
   if (P == Q && P) {
     ReportMissingAlias(VIDOfP, VIDOfQ, P);
     abort();
@@ -79,6 +173,7 @@ extern "C" void AbortIfMissed(void *P, unsigned VIDOfP,
 
 extern "C" void ReportIfMissed(void *P, unsigned VIDOfP,
                                void *Q, unsigned VIDOfQ) {
+  Count(NumChecksCounter);
   if (P == Q && P) {
     ReportMissingAlias(VIDOfP, VIDOfQ, P);
   }
@@ -86,6 +181,7 @@ extern "C" void ReportIfMissed(void *P, unsigned VIDOfP,
 
 extern "C" void SilenceIfMissed(void *P, unsigned VIDOfP,
                                 void *Q, unsigned VIDOfQ) {
+  Count(NumChecksCounter);
   if (P == Q && P) {
     SilenceMissingAlias(VIDOfP, VIDOfQ, P);
   }
@@ -94,13 +190,20 @@ extern "C" void SilenceIfMissed(void *P, unsigned VIDOfP,
 typedef void (*FreeFuncType)(void *Arg);
 
 static void DelayedFree(void *Item, queue<void*> &Queue, FreeFuncType Free) {
+  uint64_t Start = StartTiming();
+  bool Released = false;
   pthread_spin_lock(&Global.FreeLock);
   Queue.push(Item);
   if (Queue.size() > Environment::QueueSize) {
     Free(Queue.front());
     Queue.pop();
+    Released = true;
   }
   pthread_spin_unlock(&Global.FreeLock);
+  Count(NumQuarantinedCounter);
+  if (Released)
+    Count(NumReleasedCounter);
+  StopTiming(QuarantineCyclesCounter, Start);
 }
 
 extern "C" void ng_free(void *MemBlock) {
@@ -4,79 +4,1262 @@
 // the C++ name mangling and make the instrumentation easier.
 
 
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <errno.h>
+#include <fcntl.h>
 #include <iostream>
+#include <sched.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stack>
+#include <stdio_ext.h>
 #include <string>
 #include <sstream>
 #include <unistd.h>
 #include <vector>
-#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
 
+#ifdef NG_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef NG_HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
 #include "rcs/IDAssigner.h"
 
+#include "dyn-aa/HookTelemetry.h"
+#include "dyn-aa/LogFormat.h"
 #include "dyn-aa/LogRecord.h"
+#include "dyn-aa/LogStream.h"
 
 using namespace std;
 using namespace rcs;
 using namespace neongoby;
 
+// A single-producer single-consumer ring of log bytes. The owning thread
+// appends records, and the writer thread drains them to the log file, or the
+// analyzer drains them from a stream slot.
+struct LogRing {
+  LogRing(int FD, size_t Capacity):
+      FD(FD), Capacity(Capacity), Head(&OwnHead), Tail(&OwnTail), Slot(NULL),
+      OwnHead(0), OwnTail(0), NumStalls(0) {
+    Data = new char[Capacity];
+  }
+
+  // The ring of <Slot>, whose bytes are at <Data> in the shared memory.
+  LogRing(LogStreamSlot *Slot, char *Data, size_t Capacity):
+      FD(-1), Data(Data), Capacity(Capacity), Head(&Slot->Head),
+      Tail(&Slot->Tail), Slot(Slot), OwnHead(0), OwnTail(0), NumStalls(0) {}
+
+  ~LogRing() {
+    if (!Slot)
+      delete[] Data;
+  }
+
+  int FD;
+  char *Data;
+  // Capacity is a power of two, so that Head and Tail can grow monotonically
+  // and be masked into offsets.
+  size_t Capacity;
+  // Only the producer writes Head, and only the consumer writes Tail. They
+  // point to OwnHead and OwnTail, or into the stream slot.
+  volatile uint64_t *Head;
+  volatile uint64_t *Tail;
+  LogStreamSlot *Slot;
+  volatile uint64_t OwnHead;
+  volatile uint64_t OwnTail;
+  // How many times the producer found the ring full and had to wait.
+  unsigned long NumStalls;
+};
+
+// A log file written through a window mapped into memory. The window is
+// extended with ftruncate in chunks of LogMappingChunkSize bytes, and the file
+// is truncated to the bytes actually written when it is closed.
+struct LogMapping {
+  LogMapping(int FD, size_t Size):
+      FD(FD), Window(NULL), WindowStart(0), WindowSize(0), Size(Size) {}
+
+  int FD;
+  char *Window;
+  // The file offset of the window, which is page-aligned.
+  size_t WindowStart;
+  size_t WindowSize;
+  // Number of bytes written to the file.
+  size_t Size;
+};
+
+// A log file written with io_uring. The owning thread fills its buffers in
+// turn, and submits each full one as a write at its offset in the file
+// without waiting for it. A buffer is refilled after its write completes, so
+// the thread waits only if all buffers are being written.
+struct LogUring {
+  LogUring(int FD, size_t BufferSize, unsigned NumBuffers):
+      FD(FD), RingFD(-1), SQRing(NULL), CQRing(NULL), SQEs(NULL),
+      SQRingSize(0), CQRingSize(0), SQEsSize(0), BufferSize(BufferSize),
+      Buffers(NumBuffers), WriteSizes(NumBuffers, 0), NumWrites(0),
+      Current(0), Used(0), Offset(0), Size(0) {}
+
+  int FD;
+  int RingFD;
+  // The submission and completion queues shared with the kernel.
+  char *SQRing, *CQRing;
+  struct io_uring_sqe *SQEs;
+  size_t SQRingSize, CQRingSize, SQEsSize;
+  unsigned *SQHead, *SQTail, SQMask, *SQArray;
+  unsigned *CQHead, *CQTail, CQMask;
+  struct io_uring_cqe *CQEs;
+  // Each buffer is aligned for O_DIRECT and holds BufferSize bytes.
+  size_t BufferSize;
+  vector<char *> Buffers;
+  // The size of the write of each buffer, or 0 if it is not being written.
+  vector<size_t> WriteSizes;
+  unsigned NumWrites;
+  // The buffer being filled, and the bytes in it.
+  unsigned Current;
+  size_t Used;
+  // The file offset of the current buffer.
+  uint64_t Offset;
+  // Number of bytes appended to the file.
+  uint64_t Size;
+};
+
+// The segments of a log file, see LogSegmentHeader. Appended to through the
+// log's File, Ring, Mapping, or Uring.
+struct LogSegments {
+  LogSegments(FILE *File, LogRing *Ring, LogMapping *Mapping, LogUring *Uring,
+              pid_t ThreadID, uint64_t Offset, uint64_t NumRecords):
+      File(File), Ring(Ring), Mapping(Mapping), Uring(Uring),
+      ThreadID(ThreadID), Offset(Offset), Used(0), Full(false),
+      NumRecords(NumRecords), Exited(false) {}
+
+  FILE *File;
+  LogRing *Ring;
+  LogMapping *Mapping;
+  LogUring *Uring;
+  // The thread owning the log.
+  pid_t ThreadID;
+  // The file offset of the current segment, or of the first one if Used is
+  // 0.
+  uint64_t Offset;
+  // Bytes used in the current segment, including its header.
+  size_t Used;
+  // Set when the next records must go to a new segment.
+  bool Full;
+  // Records appended to the log so far, including those of the parent's log
+  // for a forked child.
+  uint64_t NumRecords;
+  vector<LogSegmentIndexEntry> Index;
+  // Whether the current segment has the layout of each function's frame,
+  // indexed by the function ID, so that each segment can be decoded on its
+  // own.
+  vector<bool> LoggedFrameLayouts;
+  // Set under Lock when the owning thread exits, after flushing its block.
+  // Only the owner appends to a log, except that FinalizeMemHooks closes the
+  // logs of exited threads.
+  bool Exited;
+};
+
+// Each thread encodes its records into its LogBlock, which is appended to the
+// log file as a whole when it is full. A block of a compressed log is
+// compressed first, and starts with a fresh LogCodecState, so that it can be
+// decoded on its own. A block of an uncompressed log is appended as is, never
+// spans two segments, and continues the LogCodecState of its segment.
+struct LogBlock {
+  LogBlock(size_t Capacity, LogSegments *Segments, bool IsCompressed):
+      Size(0), Capacity(Capacity), End(0), FastEnd(0), NumRecords(0),
+      State(), Segments(Segments) {
+    Data = new char[Capacity];
+#ifdef NG_HAVE_ZSTD
+    Compressed = NULL;
+    CompressedCapacity = 0;
+    Context = NULL;
+    if (IsCompressed) {
+      CompressedCapacity = ZSTD_compressBound(Capacity);
+      Compressed = new char[sizeof(LogBlockHeader) + CompressedCapacity];
+      Context = ZSTD_createCCtx();
+      assert(Context);
+    }
+#endif
+  }
+
+  ~LogBlock() {
+    delete[] Data;
+#ifdef NG_HAVE_ZSTD
+    delete[] Compressed;
+    ZSTD_freeCCtx(Context);
+#endif
+  }
+
+  char *Data;
+  size_t Size;
+  size_t Capacity;
+  // Records are encoded below End, which is less than Capacity if the
+  // current segment has less room left. The hooks' fast path encodes below
+  // FastEnd, which is End unless the slow path has to see every record.
+  size_t End;
+  size_t FastEnd;
+  unsigned NumRecords;
+  LogCodecState State;
+  // The log file of the owning thread.
+  LogSegments *Segments;
+#ifdef NG_HAVE_ZSTD
+  char *Compressed;
+  size_t CompressedCapacity;
+  ZSTD_CCtx *Context;
+#endif
+};
+
+// An element of the frame layout table MemoryInstrumenter emits for each
+// function whose entry-block allocas are coalesced.
+struct FrameSlotLayout {
+  unsigned AllocatedBy;
+  unsigned Offset;
+  unsigned Bound;
+};
+
+// An element of the table of global variables and functions MemoryInstrumenter
+// emits for HookGlobalsAlloc. <Hooked> is nonzero if the pointer to the global
+// is hooked as well.
+struct GlobalAllocEntry {
+  unsigned ValueID;
+  unsigned Hooked;
+  void *Address;
+  unsigned long Bound;
+};
+
+enum LogStampKind {
+  NoStamp,
+  // A global counter, from which each thread reserves LogStampBatch stamps
+  // at a time.
+  CounterStamp,
+  // The time stamp counter of the CPU.
+  TSCStamp
+};
+
+enum LogWriterKind {
+  // Each thread fwrite()s its records directly.
+  StdioWriter,
+  // Each thread appends to its LogRing, and a background thread drains them.
+  RingWriter,
+  // Each thread stores its records into its LogMapping.
+  MmapWriter,
+  // Each thread appends to its LogRing in a stream slot of the shared memory
+  // LOG_SHM, and an analyzer process drains them. See LogStreamArea.
+  ShmWriter,
+  // Each thread submits its records to the kernel in large buffers through
+  // its LogUring.
+  UringWriter
+};
+
 static string LogDirName;
+static LogWriterKind LogWriter = StdioWriter;
+static size_t LogRingSize = 4 * 1024 * 1024;
 static __thread FILE *MyLogFile = NULL;
 static vector<FILE *> LogFiles;
+static __thread LogRing *MyLogRing = NULL;
+static vector<LogRing *> LogRings;
+static size_t LogMappingChunkSize = 64 * 1024 * 1024;
+static __thread LogMapping *MyLogMapping = NULL;
+static vector<LogMapping *> LogMappings;
+static size_t LogUringBufferSize = 1024 * 1024;
+static unsigned LogUringDepth = 4;
+// Whether UringWriter opens the log files with O_DIRECT, bypassing the page
+// cache.
+static bool LogUringDirect = false;
+// O_DIRECT needs buffers, offsets and sizes aligned to the logical block
+// size of the file system, which this is a multiple of.
+static const size_t LogUringAlignment = 4096;
+static __thread LogUring *MyLogUring = NULL;
+static vector<LogUring *> LogUrings;
+// The shared memory of ShmWriter, created by the analyzer.
+static string LogShmName;
+static LogStreamArea *StreamArea = NULL;
+// The rings of the current process's stream slots.
+static vector<LogRing *> StreamRings;
+// Each segment takes LogSegmentSize bytes of the log.
+static size_t LogSegmentSize = 64 * 1024 * 1024;
+static __thread LogSegments *MySegments = NULL;
+static vector<LogSegments *> AllLogSegments;
+// Its destructor, ReleaseMyLog, flushes the log of a thread when it exits.
+static pthread_key_t MyLogKey;
+static void ReleaseMyLog(void *);
+// Passed to InitMemHooks by the instrumented program.
+static uint64_t ModuleHash = 0;
+// Set by FinalizeMemHooks, after which the log files are closed and records
+// are dropped.
+static bool LogsClosed = false;
 static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+// The writer thread sleeps on WriterCond until a producer stalls or the
+// polling interval expires.
+static pthread_t WriterThread;
+static bool WriterRunning = false;
+static volatile bool WriterStopping = false;
+static pthread_mutex_t WriterLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t WriterCond = PTHREAD_COND_INITIALIZER;
+// LogFormat flags of the log files, e.g. LogFormat::DeltaEncoding.
+static uint16_t LogFlags = 0;
+static size_t LogBlockSize = 1024 * 1024;
+// The size of the blocks of uncompressed logs. They only buffer records for
+// the hooks' fast path, so they are smaller, losing fewer records if the
+// program crashes.
+static size_t LogStageSize = 64 * 1024;
+static LogStampKind LogStamp = NoStamp;
+static volatile uint64_t StampCounter = 0;
+// Set by LOG_STAMP_BATCH. Reserving a batch of stamps at a time keeps the
+// threads from contending for StampCounter on every record, but orders the
+// records of different threads only as well as their batches, e.g. a free in
+// one thread may be merged after a later use in another. So the default, 1,
+// orders them exactly.
+static uint64_t LogStampBatch = 1;
+// The current thread's reserved stamps not used yet, [MyNextStamp,
+// MyStampEnd).
+static __thread uint64_t MyNextStamp = 0, MyStampEnd = 0;
+// Set if LogFlags has LogFormat::Compressed.
+static __thread LogBlock *MyLogBlock = NULL;
+static vector<LogBlock *> LogBlocks;
+// The log of the thread calling fork, its size and its number of records at
+// that time, recorded by HookBeforeFork for the child.
+static string ForkParentLogName;
+static uint64_t ForkParentLogSize = 0;
+static uint64_t ForkParentNumRecords = 0;
 static __thread int NumActualArgs;
-// These two thread-specific flags are used to workaround the issue with signal
-// handling.
-static __thread bool IsLogging = false;
-static __thread bool DisableLogging = false;
+// A signal handler may log while the thread it interrupts is in the middle of
+// PrintLogRecord. Such nested records are queued in PendingRecords, and the
+// interrupted PrintLogRecord appends them after its own record. A handler runs
+// to completion before the code it interrupts resumes, so every slot reserved
+// below NumPendingRecords is filled by the time they are drained. The queue
+// lives in static TLS, which glibc carves out of every thread's stack, so it
+// holds only enough records for a few nested handlers; the rest are dropped and
+// counted in NumDroppedRecords.
+static const unsigned MaxNumPendingRecords = 64;
+static __thread volatile unsigned LogDepth = 0;
+static __thread LogRecord PendingRecords[MaxNumPendingRecords];
+static __thread uint64_t PendingStamps[MaxNumPendingRecords];
+static __thread volatile unsigned NumPendingRecords = 0;
+// Records dropped because PendingRecords was full.
+static volatile unsigned long NumDroppedRecords = 0;
+// Sampling only drops TopLevel records. MemAlloc, Enter and Return records are
+// always logged, so that DynamicAliasAnalysis still versions addresses and
+// tracks contexts correctly.
+// The sampling window is open for SampleWindowOn out of every
+// SampleWindowPeriod milliseconds. The sampler thread opens and closes it.
+static unsigned SampleWindowOn = 0, SampleWindowPeriod = 0;
+static volatile bool SampleWindowOpen = true;
+// One in SampleRates[FunctionID] TopLevel records of a function is logged,
+// or one in DefaultSampleRate for functions not in SampleRates. A rate of 0
+// logs none.
+static unsigned DefaultSampleRate = 1;
+static vector<unsigned> SampleRates;
+// The functions being executed by the current thread, maintained only if
+// SampleRates is not empty. Functions deeper than MaxNumSampledFrames are
+// sampled with DefaultSampleRate.
+static const unsigned MaxNumSampledFrames = 1024;
+static __thread unsigned SampledFrames[MaxNumSampledFrames];
+static __thread unsigned NumSampledFrames = 0;
+static __thread uint32_t SampleSeed = 0;
+// With LOG_DEDUP, a TopLevel record identical to the last one the thread
+// logged for the same pointer is dropped, unless a function entry or return
+// on the thread (MyDedupEpoch) or an allocation or free on any thread
+// (AllocEpoch) happened in between. DynamicAliasAnalysis would only remove
+// and re-add the same points-to for it. A record repeating an older value of
+// the pointer is logged, because the pointer has pointed elsewhere since.
+struct DedupEntry {
+  unsigned ValueID;
+  void *PointeeAddress;
+  void *LoadedFrom;
+  unsigned Epoch;
+  unsigned AllocEpoch;
+};
+static bool Dedup = false;
+// Indexed by the top 8 bits of a hash of the pointer's value ID.
+static __thread DedupEntry DedupCache[256];
+// Starts from 1 so that the zeroed entries never match.
+static __thread unsigned MyDedupEpoch = 1;
+static volatile unsigned AllocEpoch = 0;
+// Whether LOG_DEDUP or sampling may drop TopLevel records, so that
+// HookTopLevel needs to call FilterTopLevel.
+static bool FilteringTopLevel = false;
+// Indices of the telemetry counters. The first LogFormat::NumRecordTypes
+// count the records of each type.
+enum HookCounter {
+  // Bytes appended to the log files, after compression if any.
+  BytesWrittenCounter = LogFormat::NumRecordTypes,
+  // Compressed blocks, ring drains by the writer thread, and remaps of mmap
+  // windows.
+  NumFlushesCounter,
+  FlushCyclesCounter,
+  // Times the thread found its ring full, and the cycles it waited.
+  NumStallsCounter,
+  StallCyclesCounter,
+  // Calls to PrintLogRecord, and an estimate of the cycles spent in them.
+  NumHookCallsCounter,
+  HookCyclesCounter,
+  NumHookCounters
+};
+static const char *const HookCounterNames[NumHookCounters] = {
+  "records.MemAlloc", "records.TopLevel", "records.Enter", "records.Store",
+  "records.Call", "records.Return", "records.BasicBlock", "records.FrameSlot",
+  "records.FrameAlloc", "records.MemFree", "records.GlobalAlloc",
+  "bytes_written", "flushes", "flush_cycles", "ring_stalls", "stall_cycles",
+  "hook_calls", "hook_cycles"
+};
+typedef ThreadCounters<NumHookCounters> HookCounters;
+// Set by NG_TELEMETRY. The counters are dumped to LOG_DIR/telemetry-<pid> at
+// exit and on SIGUSR2.
+static bool TelemetryEnabled = false;
+static TelemetryRegistry<NumHookCounters> Telemetry(HookCounterNames);
+static __thread HookCounters *MyCounters = NULL;
 
-static string GetLogFileName(pid_t ThreadID) {
+// Keeps the compiler from moving memory accesses across it, which is enough to
+// order them with a signal handler on the same thread.
+static inline void CompilerBarrier() {
+  __asm__ __volatile__("" ::: "memory");
+}
+
+// Returns the current thread's counters, or NULL if telemetry is disabled.
+static inline HookCounters *GetMyCounters() {
+  if (!TelemetryEnabled)
+    return NULL;
+  if (!MyCounters)
+    MyCounters = Telemetry.registerThread();
+  return MyCounters;
+}
+
+static inline void Count(unsigned Counter, uint64_t N = 1) {
+  if (HookCounters *Counters = GetMyCounters())
+    Counters->Counts[Counter] += N;
+}
+
+// Returns the start of a timed section, which is 0 if telemetry is disabled.
+static inline uint64_t StartTiming() {
+  return TelemetryEnabled ? HookTelemetry::ReadCycleCounter() : 0;
+}
+
+static inline void StopTiming(unsigned Counter, uint64_t Start) {
+  if (Start)
+    Count(Counter, HookTelemetry::ReadCycleCounter() - Start);
+}
+
+// The SIGUSR2 action DumpTelemetry replaced, e.g. AliasChecker's.
+static struct sigaction PreviousTelemetryAction;
+
+static void DumpTelemetry(int Signal, siginfo_t *Info, void *Context) {
+  Telemetry.dump();
+  HookTelemetry::ChainSignal(PreviousTelemetryAction, Signal, Info, Context);
+}
+
+static void SetTelemetryFileName() {
+  Telemetry.setFileName((LogDirName + "/telemetry-").c_str(), getpid());
+}
+
+static string GetLogBaseName(pid_t ThreadID) {
   ostringstream OS;
-  OS << LogDirName << "/pts-" << ThreadID;
+  OS << "pts-" << ThreadID;
   return OS.str();
 }
 
+static string GetLogFileName(pid_t ThreadID) {
+  return LogDirName + "/" + GetLogBaseName(ThreadID);
+}
+
 static string GetLogFileName() {
   pid_t ThreadID = syscall(SYS_gettid);
   return GetLogFileName(ThreadID);
 }
 
-// TODO: The Append flag is not necessary. We could just uniformly use "ab".
-static void OpenLogFile(bool Append) {
-  MyLogFile = fopen(GetLogFileName().c_str(), Append ? "ab" : "wb");
-  if (!MyLogFile)
-    perror("fopen");
-  assert(MyLogFile);
+static void WriteAll(int FD, const char *Buffer, size_t Length) {
+  while (Length > 0) {
+    ssize_t R = write(FD, Buffer, Length);
+    if (R == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("write");
+      assert(false);
+    }
+    Buffer += R;
+    Length -= R;
+  }
+}
+
+// Writes out everything the producer of <Ring> has published so far.
+// Returns whether anything was written.
+static bool DrainLogRing(LogRing *Ring) {
+  size_t Head = *Ring->Head;
+  // Read the published bytes only after reading Head.
+  __sync_synchronize();
+  size_t Tail = *Ring->Tail;
+  if (Head == Tail)
+    return false;
+  uint64_t Start = StartTiming();
+  size_t Offset = Tail & (Ring->Capacity - 1);
+  size_t Length = Head - Tail;
+  size_t FirstPart = min(Length, Ring->Capacity - Offset);
+  WriteAll(Ring->FD, Ring->Data + Offset, FirstPart);
+  WriteAll(Ring->FD, Ring->Data, Length - FirstPart);
+  // Finish reading the bytes before handing the space back to the producer.
+  __sync_synchronize();
+  *Ring->Tail = Head;
+  Count(NumFlushesCounter);
+  StopTiming(FlushCyclesCounter, Start);
+  return true;
+}
+
+static void *WriterMain(void *) {
+  while (true) {
+    bool Stopping = WriterStopping;
+    bool Progressed = false;
+    pthread_mutex_lock(&Lock);
+    for (size_t i = 0; i < LogRings.size(); ++i)
+      Progressed |= DrainLogRing(LogRings[i]);
+    pthread_mutex_unlock(&Lock);
+    // Do one more pass after observing WriterStopping, so that everything
+    // published before the stop request is written.
+    if (Stopping)
+      break;
+    if (!Progressed) {
+      struct timespec Deadline;
+      clock_gettime(CLOCK_REALTIME, &Deadline);
+      Deadline.tv_nsec += 1000 * 1000;
+      if (Deadline.tv_nsec >= 1000 * 1000 * 1000) {
+        Deadline.tv_sec += 1;
+        Deadline.tv_nsec -= 1000 * 1000 * 1000;
+      }
+      pthread_mutex_lock(&WriterLock);
+      if (!WriterStopping)
+        pthread_cond_timedwait(&WriterCond, &WriterLock, &Deadline);
+      pthread_mutex_unlock(&WriterLock);
+    }
+  }
+  return NULL;
+}
+
+// Creates a thread of the memory hooks. The thread inherits a full signal
+// mask, so that the program's signal handlers never run (and log) on it.
+static void CreateHookThread(pthread_t *Thread, void *(*Main)(void *)) {
+  sigset_t FullMask, OldMask;
+  sigfillset(&FullMask);
+  pthread_sigmask(SIG_SETMASK, &FullMask, &OldMask);
+  int R = pthread_create(Thread, NULL, Main, NULL);
+  assert(R == 0);
+  pthread_sigmask(SIG_SETMASK, &OldMask, NULL);
+}
+
+static void StartWriter() {
+  assert(!WriterRunning);
+  WriterStopping = false;
+  CreateHookThread(&WriterThread, WriterMain);
+  WriterRunning = true;
+}
+
+// Stops the writer thread after it drains all rings.
+static void StopWriter() {
+  if (!WriterRunning)
+    return;
+  pthread_mutex_lock(&WriterLock);
+  WriterStopping = true;
+  pthread_cond_signal(&WriterCond);
+  pthread_mutex_unlock(&WriterLock);
+  int R = pthread_join(WriterThread, NULL);
+  assert(R == 0);
+  WriterRunning = false;
+}
+
+static void SleepMilliseconds(unsigned Milliseconds) {
+  struct timespec Duration;
+  Duration.tv_sec = Milliseconds / 1000;
+  Duration.tv_nsec = (long)(Milliseconds % 1000) * 1000 * 1000;
+  nanosleep(&Duration, NULL);
+}
+
+static void *SamplerMain(void *) {
+  while (true) {
+    SampleWindowOpen = true;
+    SleepMilliseconds(SampleWindowOn);
+    SampleWindowOpen = false;
+    SleepMilliseconds(SampleWindowPeriod - SampleWindowOn);
+  }
+  return NULL;
+}
+
+// The sampler thread runs until the program exits.
+static void StartSampler() {
+  if (SampleWindowPeriod == 0)
+    return;
+  pthread_t SamplerThread;
+  CreateHookThread(&SamplerThread, SamplerMain);
+  pthread_detach(SamplerThread);
+}
+
+static void AppendToLogRing(LogRing *Ring, const void *Buffer, size_t Length) {
+  // A compressed block may be larger than the ring.
+  while (Length > Ring->Capacity) {
+    AppendToLogRing(Ring, Buffer, Ring->Capacity);
+    Buffer = (const char *)Buffer + Ring->Capacity;
+    Length -= Ring->Capacity;
+  }
+  size_t Head = *Ring->Head;
+  if (Head + Length - *Ring->Tail > Ring->Capacity) {
+    // The ring is full. Wake up the writer, and wait for it to make room.
+    ++Ring->NumStalls;
+    Count(NumStallsCounter);
+    uint64_t Start = StartTiming();
+    do {
+      if (Ring->Slot) {
+        // Wait for the analyzer, however long it takes.
+        sched_yield();
+        continue;
+      }
+      if (!WriterRunning) {
+        // E.g. logging after FinalizeMemHooks. Nobody else drains the ring.
+        DrainLogRing(Ring);
+        break;
+      }
+      pthread_cond_signal(&WriterCond);
+      sched_yield();
+    } while (Head + Length - *Ring->Tail > Ring->Capacity);
+    StopTiming(StallCyclesCounter, Start);
+  }
+  // Do not overwrite the bytes before the writer finishes reading them.
+  __sync_synchronize();
+  size_t Offset = Head & (Ring->Capacity - 1);
+  size_t FirstPart = min(Length, Ring->Capacity - Offset);
+  memcpy(Ring->Data + Offset, Buffer, FirstPart);
+  memcpy(Ring->Data, (const char *)Buffer + FirstPart, Length - FirstPart);
+  // Publish the bytes before publishing the new Head.
+  __sync_synchronize();
+  *Ring->Head = Head + Length;
+}
+
+static void UnmapLogWindow(LogMapping *Mapping) {
+  if (Mapping->Window) {
+    munmap(Mapping->Window, Mapping->WindowSize);
+    Mapping->Window = NULL;
+  }
+}
+
+// Unmaps the window, and cuts the preallocated tail off the file.
+static void CloseLogWindow(LogMapping *Mapping) {
+  UnmapLogWindow(Mapping);
+  int R = ftruncate(Mapping->FD, Mapping->Size);
+  assert(R == 0);
+}
+
+// Maps a window that can hold at least <Length> more bytes.
+static void ExtendLogWindow(LogMapping *Mapping, size_t Length) {
+  uint64_t Start = StartTiming();
+  UnmapLogWindow(Mapping);
+  size_t PageSize = sysconf(_SC_PAGESIZE);
+  Mapping->WindowStart = Mapping->Size / PageSize * PageSize;
+  Mapping->WindowSize = LogMappingChunkSize;
+  while (Mapping->WindowStart + Mapping->WindowSize < Mapping->Size + Length)
+    Mapping->WindowSize += LogMappingChunkSize;
+  int R = ftruncate(Mapping->FD, Mapping->WindowStart + Mapping->WindowSize);
+  if (R == -1)
+    perror("ftruncate");
+  assert(R == 0);
+  void *Window = mmap(NULL, Mapping->WindowSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, Mapping->FD, Mapping->WindowStart);
+  if (Window == MAP_FAILED)
+    perror("mmap");
+  assert(Window != MAP_FAILED);
+  Mapping->Window = (char *)Window;
+  Count(NumFlushesCounter);
+  StopTiming(FlushCyclesCounter, Start);
+}
+
+static void AppendToLogMapping(LogMapping *Mapping, const void *Buffer,
+                               size_t Length) {
+  if (Mapping->Window == NULL ||
+      Mapping->Size + Length > Mapping->WindowStart + Mapping->WindowSize) {
+    ExtendLogWindow(Mapping, Length);
+  }
+  memcpy(Mapping->Window + (Mapping->Size - Mapping->WindowStart),
+         Buffer, Length);
+  Mapping->Size += Length;
+}
+
+#ifdef NG_HAVE_IO_URING
+// The io_uring system calls. libc has no wrappers for them.
+static int IoUringSetup(unsigned Entries, struct io_uring_params *Params) {
+  return syscall(__NR_io_uring_setup, Entries, Params);
+}
+
+static int IoUringEnter(int RingFD, unsigned ToSubmit, unsigned MinComplete,
+                        unsigned Flags) {
+  return syscall(__NR_io_uring_enter, RingFD, ToSubmit, MinComplete, Flags,
+                 NULL, 0);
+}
+
+// Sets up the io_uring of <Uring>, and allocates its buffers. Returns false
+// if the kernel does not support io_uring.
+static bool SetUpLogUring(LogUring *Uring) {
+  struct io_uring_params Params;
+  memset(&Params, 0, sizeof Params);
+  Uring->RingFD = IoUringSetup(Uring->Buffers.size(), &Params);
+  if (Uring->RingFD == -1)
+    return false;
+  Uring->SQRingSize = Params.sq_off.array + Params.sq_entries *
+      sizeof(unsigned);
+  Uring->CQRingSize = Params.cq_off.cqes + Params.cq_entries *
+      sizeof(struct io_uring_cqe);
+  // Newer kernels map both queues with one mmap.
+  if (Params.features & IORING_FEAT_SINGLE_MMAP) {
+    Uring->SQRingSize = max(Uring->SQRingSize, Uring->CQRingSize);
+    Uring->CQRingSize = 0;
+  }
+  void *SQRing = mmap(NULL, Uring->SQRingSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, Uring->RingFD,
+                      IORING_OFF_SQ_RING);
+  assert(SQRing != MAP_FAILED);
+  void *CQRing = SQRing;
+  if (Uring->CQRingSize > 0) {
+    CQRing = mmap(NULL, Uring->CQRingSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, Uring->RingFD,
+                  IORING_OFF_CQ_RING);
+    assert(CQRing != MAP_FAILED);
+  }
+  Uring->SQEsSize = Params.sq_entries * sizeof(struct io_uring_sqe);
+  void *SQEs = mmap(NULL, Uring->SQEsSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, Uring->RingFD,
+                    IORING_OFF_SQES);
+  assert(SQEs != MAP_FAILED);
+  Uring->SQRing = (char *)SQRing;
+  Uring->CQRing = (char *)CQRing;
+  Uring->SQEs = (struct io_uring_sqe *)SQEs;
+  Uring->SQHead = (unsigned *)(Uring->SQRing + Params.sq_off.head);
+  Uring->SQTail = (unsigned *)(Uring->SQRing + Params.sq_off.tail);
+  Uring->SQMask = *(unsigned *)(Uring->SQRing + Params.sq_off.ring_mask);
+  Uring->SQArray = (unsigned *)(Uring->SQRing + Params.sq_off.array);
+  Uring->CQHead = (unsigned *)(Uring->CQRing + Params.cq_off.head);
+  Uring->CQTail = (unsigned *)(Uring->CQRing + Params.cq_off.tail);
+  Uring->CQMask = *(unsigned *)(Uring->CQRing + Params.cq_off.ring_mask);
+  Uring->CQEs = (struct io_uring_cqe *)(Uring->CQRing + Params.cq_off.cqes);
+  for (size_t i = 0; i < Uring->Buffers.size(); ++i) {
+    void *Buffer;
+    int R = posix_memalign(&Buffer, LogUringAlignment, Uring->BufferSize);
+    assert(R == 0);
+    Uring->Buffers[i] = (char *)Buffer;
+  }
+  return true;
+}
+
+// Releases the io_uring and the buffers of <Uring>, e.g. the parent's in a
+// forked child, without waiting for its writes.
+static void TearDownLogUring(LogUring *Uring) {
+  munmap(Uring->SQEs, Uring->SQEsSize);
+  if (Uring->CQRingSize > 0)
+    munmap(Uring->CQRing, Uring->CQRingSize);
+  munmap(Uring->SQRing, Uring->SQRingSize);
+  close(Uring->RingFD);
+  for (size_t i = 0; i < Uring->Buffers.size(); ++i)
+    free(Uring->Buffers[i]);
+}
+
+// Retires the completed writes of <Uring>, waiting for at least one if
+// <Wait> is set.
+static void ReapLogUring(LogUring *Uring, bool Wait) {
+  if (Wait) {
+    int R;
+    do {
+      R = IoUringEnter(Uring->RingFD, 0, 1, IORING_ENTER_GETEVENTS);
+    } while (R == -1 && errno == EINTR);
+    assert(R != -1);
+  }
+  unsigned Head = *Uring->CQHead;
+  while (Head != __atomic_load_n(Uring->CQTail, __ATOMIC_ACQUIRE)) {
+    const struct io_uring_cqe &CQE = Uring->CQEs[Head & Uring->CQMask];
+    size_t &WriteSize = Uring->WriteSizes[CQE.user_data];
+    if (CQE.res != (int)WriteSize) {
+      fprintf(stderr, "Failed to write a log: %s\n",
+              CQE.res < 0 ? strerror(-CQE.res) : "short write");
+      assert(false);
+    }
+    WriteSize = 0;
+    --Uring->NumWrites;
+    ++Head;
+  }
+  __atomic_store_n(Uring->CQHead, Head, __ATOMIC_RELEASE);
+}
+
+// Submits a write of the first <Length> bytes of the current buffer.
+static void SubmitLogUringBuffer(LogUring *Uring, size_t Length) {
+  uint64_t Start = StartTiming();
+  unsigned Tail = *Uring->SQTail;
+  unsigned Index = Tail & Uring->SQMask;
+  struct io_uring_sqe &SQE = Uring->SQEs[Index];
+  memset(&SQE, 0, sizeof SQE);
+  SQE.opcode = IORING_OP_WRITE;
+  SQE.fd = Uring->FD;
+  SQE.addr = (uintptr_t)Uring->Buffers[Uring->Current];
+  SQE.len = Length;
+  SQE.off = Uring->Offset;
+  SQE.user_data = Uring->Current;
+  Uring->SQArray[Index] = Index;
+  Uring->WriteSizes[Uring->Current] = Length;
+  ++Uring->NumWrites;
+  __atomic_store_n(Uring->SQTail, Tail + 1, __ATOMIC_RELEASE);
+  int R;
+  do {
+    R = IoUringEnter(Uring->RingFD, 1, 0, 0);
+  } while (R == -1 && errno == EINTR);
+  assert(R == 1);
+  Count(NumFlushesCounter);
+  StopTiming(FlushCyclesCounter, Start);
+}
+
+// Submits the full current buffer, and moves on to the next one, waiting
+// for its previous write if necessary.
+static void RotateLogUring(LogUring *Uring) {
+  SubmitLogUringBuffer(Uring, Uring->BufferSize);
+  Uring->Offset += Uring->BufferSize;
+  Uring->Current = (Uring->Current + 1) % Uring->Buffers.size();
+  Uring->Used = 0;
+  ReapLogUring(Uring, false);
+  if (Uring->WriteSizes[Uring->Current] > 0) {
+    Count(NumStallsCounter);
+    uint64_t Start = StartTiming();
+    while (Uring->WriteSizes[Uring->Current] > 0)
+      ReapLogUring(Uring, true);
+    StopTiming(StallCyclesCounter, Start);
+  }
+}
+
+static void AppendToLogUring(LogUring *Uring, const void *Buffer,
+                             size_t Length) {
+  while (Length > 0) {
+    size_t Part = min(Length, Uring->BufferSize - Uring->Used);
+    memcpy(Uring->Buffers[Uring->Current] + Uring->Used, Buffer, Part);
+    Uring->Used += Part;
+    Uring->Size += Part;
+    Buffer = (const char *)Buffer + Part;
+    Length -= Part;
+    if (Uring->Used == Uring->BufferSize)
+      RotateLogUring(Uring);
+  }
+}
+
+// Writes out everything appended to <Uring> so far, and waits for it, so that
+// the file holds the whole log. The current buffer keeps filling, and is
+// written again at the same offset when it is full.
+static void FlushLogUring(LogUring *Uring) {
+  if (Uring->Used > 0) {
+    // The bytes beyond Used are cut off below.
+    size_t Length = Uring->Used;
+    if (LogUringDirect)
+      Length = (Length + LogUringAlignment - 1) / LogUringAlignment *
+          LogUringAlignment;
+    SubmitLogUringBuffer(Uring, Length);
+  }
+  while (Uring->NumWrites > 0)
+    ReapLogUring(Uring, true);
+  int R = ftruncate(Uring->FD, Uring->Size);
+  assert(R == 0);
+}
+#else
+static void AppendToLogUring(LogUring *Uring, const void *Buffer,
+                             size_t Length) {
+  assert(false && "io_uring requires building with NG_HAVE_IO_URING");
+}
+
+static void FlushLogUring(LogUring *Uring) {
+}
+#endif
+
+// Appends <Length> bytes to the log file written through <File>, <Ring>,
+// <Mapping>, or <Uring>, whichever is not NULL.
+static void AppendToLog(FILE *File, LogRing *Ring, LogMapping *Mapping,
+                        LogUring *Uring, const void *Buffer, size_t Length) {
+  Count(BytesWrittenCounter, Length);
+  if (Ring) {
+    AppendToLogRing(Ring, Buffer, Length);
+  } else if (Mapping) {
+    AppendToLogMapping(Mapping, Buffer, Length);
+  } else if (Uring) {
+    AppendToLogUring(Uring, Buffer, Length);
+  } else {
+    size_t NumBytesWritten = fwrite(Buffer, Length, 1, File);
+    assert(NumBytesWritten == 1);
+  }
+}
+
+// Appends <Length> bytes to the current thread's log file.
+static void AppendToMyLog(const void *Buffer, size_t Length) {
+  AppendToLog(MyLogFile, MyLogRing, MyLogMapping, MyLogUring, Buffer, Length);
+}
+
+// Pads the current segment of <Segments>, if any, and starts a new one.
+static void StartLogSegment(LogSegments *Segments) {
+  if (Segments->Used > 0) {
+    static const char Zeros[4096] = {0};
+    for (size_t Left = LogSegmentSize - Segments->Used; Left > 0; ) {
+      size_t Length = min(Left, sizeof Zeros);
+      AppendToLog(Segments->File, Segments->Ring, Segments->Mapping,
+                  Segments->Uring, Zeros, Length);
+      Left -= Length;
+    }
+    Segments->Offset += LogSegmentSize;
+  }
+  LogSegmentHeader Header;
+  LogFormat::InitSegmentHeader(Header, Segments->ThreadID, ModuleHash,
+                               Segments->NumRecords, LogSegmentSize);
+  AppendToLog(Segments->File, Segments->Ring, Segments->Mapping,
+              Segments->Uring, &Header, sizeof Header);
+  Segments->Used = sizeof Header;
+  Segments->Full = false;
+  LogSegmentIndexEntry Entry;
+  Entry.Offset = Segments->Offset;
+  Entry.FirstRecordID = Segments->NumRecords;
+  Segments->Index.push_back(Entry);
+}
+
+// Sends the next records to a new segment, which has to log the frame
+// layouts again.
+static void EndLogSegment(LogSegments *Segments) {
+  Segments->Full = true;
+  Segments->LoggedFrameLayouts.clear();
+}
+
+// Appends <Length> bytes to the current segment, starting one if necessary.
+// The caller ensures that they fit.
+static void AppendToLogSegment(LogSegments *Segments, const void *Buffer,
+                               size_t Length) {
+  if (Segments->Used == 0 || Segments->Full)
+    StartLogSegment(Segments);
+  assert(Segments->Used + Length <= LogSegmentSize);
+  AppendToLog(Segments->File, Segments->Ring, Segments->Mapping,
+              Segments->Uring, Buffer, Length);
+  Segments->Used += Length;
+}
+
+// Appends the index of <Segments> to the log.
+static void WriteLogIndex(LogSegments *Segments) {
+  const vector<LogSegmentIndexEntry> &Index = Segments->Index;
+  if (!Index.empty()) {
+    AppendToLog(Segments->File, Segments->Ring, Segments->Mapping,
+                Segments->Uring, &Index[0],
+                Index.size() * sizeof(LogSegmentIndexEntry));
+  }
+  LogIndexTrailer Trailer;
+  LogFormat::InitIndexTrailer(Trailer, Index.size());
+  AppendToLog(Segments->File, Segments->Ring, Segments->Mapping,
+              Segments->Uring, &Trailer, sizeof Trailer);
+}
+
+// Decides where the records of the empty <Block> go, and how many fit.
+static void ResetLogBlock(LogBlock *Block) {
+  assert(Block->Size == 0);
+  if (LogFlags & LogFormat::Compressed) {
+    Block->State = LogCodecState();
+    Block->End = Block->Capacity;
+  } else {
+    LogSegments *Segments = Block->Segments;
+    if (Segments->Used > 0 && !Segments->Full &&
+        Segments->Used + LogFormat::MaxEncodedSize > LogSegmentSize)
+      EndLogSegment(Segments);
+    size_t Left;
+    if (Segments->Used == 0 || Segments->Full) {
+      // The block starts a new segment.
+      Block->State = LogCodecState();
+      Left = LogSegmentSize - sizeof(LogSegmentHeader);
+    } else {
+      Left = LogSegmentSize - Segments->Used;
+    }
+    Block->End = min(Block->Capacity, Left);
+  }
+  // The slow path counts each record.
+  Block->FastEnd = (TelemetryEnabled || LogsClosed ? 0 : Block->End);
+}
+
+// Appends the records in <Block> to the log file, compressing them if the log
+// is compressed, and starts a new block.
+static void FlushLogBlock(LogBlock *Block) {
+  if (Block->Size == 0)
+    return;
+  if (!(LogFlags & LogFormat::Compressed)) {
+    LogSegments *Segments = Block->Segments;
+    AppendToLogSegment(Segments, Block->Data, Block->Size);
+    Segments->NumRecords += Block->NumRecords;
+    Block->Size = 0;
+    Block->NumRecords = 0;
+    ResetLogBlock(Block);
+    return;
+  }
+#ifdef NG_HAVE_ZSTD
+  uint64_t Start = StartTiming();
+  size_t CompressedSize = ZSTD_compressCCtx(
+      Block->Context, Block->Compressed + sizeof(LogBlockHeader),
+      Block->CompressedCapacity, Block->Data, Block->Size,
+      LogFormat::CompressionLevel);
+  assert(!ZSTD_isError(CompressedSize));
+  LogBlockHeader Header;
+  Header.CompressedSize = CompressedSize;
+  Header.RawSize = Block->Size;
+  memcpy(Block->Compressed, &Header, sizeof Header);
+  LogSegments *Segments = Block->Segments;
+  AppendToLogSegment(Segments, Block->Compressed,
+                     sizeof Header + CompressedSize);
+  Segments->NumRecords += Block->NumRecords;
+  // Decide now whether the next block goes to a new segment, before its
+  // records are encoded, so that it logs the frame layouts it needs.
+  if (Segments->Used + sizeof Header + Block->CompressedCapacity >
+      LogSegmentSize)
+    EndLogSegment(Segments);
+  Count(NumFlushesCounter);
+  StopTiming(FlushCyclesCounter, Start);
+#else
+  assert(false && "Compression requires building with NG_HAVE_ZSTD");
+#endif
+  Block->Size = 0;
+  Block->NumRecords = 0;
+  ResetLogBlock(Block);
+}
+
+static void AppendToLogBlock(LogBlock *Block, const LogRecord &Record,
+                             uint64_t Stamp) {
+  if (Block->Size + LogFormat::MaxEncodedSize > Block->End)
+    FlushLogBlock(Block);
+  Block->Size += LogFormat::Encode(Record, Stamp, Block->Data + Block->Size,
+                                   LogFlags, Block->State);
+  ++Block->NumRecords;
+}
+
+// Maps the shared memory the analyzer created for ShmWriter, and counts the
+// current process as a producer.
+static void OpenStreamArea() {
+  int FD = shm_open(LogShmName.c_str(), O_RDWR, 0);
+  if (FD == -1) {
+    fprintf(stderr, "Cannot open %s. Start the analyzer first\n",
+            LogShmName.c_str());
+    assert(false);
+  }
+  struct stat StatBuf;
+  int R = fstat(FD, &StatBuf);
+  assert(R == 0);
+  void *Area = mmap(NULL, StatBuf.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    FD, 0);
+  if (Area == MAP_FAILED)
+    perror("mmap");
+  assert(Area != MAP_FAILED);
+  close(FD);
+  StreamArea = (LogStreamArea *)Area;
+  if ((size_t)StatBuf.st_size < sizeof(LogStreamArea) ||
+      !LogStream::IsValidArea(StreamArea) ||
+      (size_t)StatBuf.st_size < LogStream::GetAreaSize(
+          StreamArea->NumSlots, StreamArea->RingCapacity)) {
+    fprintf(stderr, "%s is not a stream area\n", LogShmName.c_str());
+    assert(false);
+  }
+  __sync_fetch_and_add(&StreamArea->NumProducers, 1);
+}
+
+// Claims a stream slot for the current thread, and returns its ring.
+static LogRing *OpenLogStream() {
+  uint32_t Index = __sync_fetch_and_add(&StreamArea->NumClaimedSlots, 1);
+  if (Index >= StreamArea->NumSlots) {
+    fprintf(stderr, "%s has only %u stream slots\n", LogShmName.c_str(),
+            StreamArea->NumSlots);
+    assert(false);
+  }
+  LogStreamSlot *Slot = LogStream::GetSlot(StreamArea, Index);
+  Slot->ProcessID = getpid();
+  Slot->ThreadID = syscall(SYS_gettid);
+  // Publish the slot after filling it in.
+  __sync_synchronize();
+  Slot->State = LogStreamSlot::Open;
+  return new LogRing(Slot, LogStream::GetRing(StreamArea, Index),
+                     StreamArea->RingCapacity);
+}
+
+// Opens the current thread's log file, and writes its header. The log of a
+// forked child starts with the first <ParentLogSize> bytes of the log named
+// <ParentLogName>, which the header refers to instead of copying, and their
+// <ParentNumRecords> records.
+static void OpenLogFile(const char *ParentLogName = NULL,
+                        uint64_t ParentLogSize = 0,
+                        uint64_t ParentNumRecords = 0) {
+  if (LogWriter == ShmWriter) {
+    pthread_mutex_lock(&Lock);
+    MyLogRing = OpenLogStream();
+    StreamRings.push_back(MyLogRing);
+    pthread_mutex_unlock(&Lock);
+  } else if (LogWriter == RingWriter || LogWriter == MmapWriter) {
+    // mmap needs the file to be readable as well.
+    int FD = open(GetLogFileName().c_str(),
+                  (LogWriter == MmapWriter ? O_RDWR : O_WRONLY) | O_CREAT |
+                  O_TRUNC,
+                  0644);
+    if (FD == -1)
+      perror("open");
+    assert(FD != -1);
+    pthread_mutex_lock(&Lock);
+    if (LogWriter == RingWriter) {
+      MyLogRing = new LogRing(FD, LogRingSize);
+      LogRings.push_back(MyLogRing);
+    } else {
+      MyLogMapping = new LogMapping(FD, 0);
+      LogMappings.push_back(MyLogMapping);
+    }
+    pthread_mutex_unlock(&Lock);
+  } else if (LogWriter == UringWriter) {
+    int FD = open(GetLogFileName().c_str(),
+                  O_WRONLY | O_CREAT | O_TRUNC |
+                  (LogUringDirect ? O_DIRECT : 0),
+                  0644);
+    if (FD == -1)
+      perror("open");
+    assert(FD != -1);
+    MyLogUring = new LogUring(FD, LogUringBufferSize, LogUringDepth);
+#ifdef NG_HAVE_IO_URING
+    bool Succeeded = SetUpLogUring(MyLogUring);
+    assert(Succeeded);
+#endif
+    pthread_mutex_lock(&Lock);
+    LogUrings.push_back(MyLogUring);
+    pthread_mutex_unlock(&Lock);
+  } else {
+    MyLogFile = fopen(GetLogFileName().c_str(), "wb");
+    if (!MyLogFile)
+      perror("fopen");
+    assert(MyLogFile);
+    pthread_mutex_lock(&Lock);
+    LogFiles.push_back(MyLogFile);
+    pthread_mutex_unlock(&Lock);
+  }
+
+  LogFileHeader Header;
+  LogFormat::InitHeader(Header,
+                        LogFlags | (ParentLogName ? LogFormat::Forked : 0));
+  AppendToMyLog(&Header, sizeof Header);
+  uint64_t HeaderSize = sizeof Header;
+  if (ParentLogName) {
+    LogParentRef Ref;
+    Ref.ParentLogSize = ParentLogSize;
+    Ref.NameLength = strlen(ParentLogName);
+    AppendToMyLog(&Ref, sizeof Ref);
+    AppendToMyLog(ParentLogName, Ref.NameLength);
+    HeaderSize += sizeof Ref + Ref.NameLength;
+  }
+
+  MySegments = new LogSegments(MyLogFile, MyLogRing, MyLogMapping, MyLogUring,
+                               syscall(SYS_gettid), HeaderSize,
+                               ParentNumRecords);
   pthread_mutex_lock(&Lock);
-  LogFiles.push_back(MyLogFile);
+  AllLogSegments.push_back(MySegments);
   pthread_mutex_unlock(&Lock);
+  bool IsCompressed = (LogFlags & LogFormat::Compressed);
+  MyLogBlock = new LogBlock(IsCompressed ? LogBlockSize : LogStageSize,
+                            MySegments, IsCompressed);
+  ResetLogBlock(MyLogBlock);
+  pthread_mutex_lock(&Lock);
+  LogBlocks.push_back(MyLogBlock);
+  pthread_mutex_unlock(&Lock);
+  pthread_setspecific(MyLogKey, MySegments);
 }
 
 static void OpenLogFileIfNecessary() {
-  if (!MyLogFile)
-    OpenLogFile(false);
+  if (!MyLogFile && !MyLogRing && !MyLogMapping && !MyLogUring)
+    OpenLogFile();
+}
+
+// Returns the file descriptor of the current thread's log file.
+static int GetMyLogFD() {
+  if (MyLogRing)
+    return MyLogRing->FD;
+  if (MyLogMapping)
+    return MyLogMapping->FD;
+  if (MyLogUring)
+    return MyLogUring->FD;
+  assert(MyLogFile);
+  return fileno(MyLogFile);
+}
+
+// Whether FinalizeMemHooks may close the log of <Segments>. Other threads may
+// still be appending to their logs, which then end without an index like the
+// log of a crashed program.
+static bool IsClosable(const LogSegments *Segments) {
+  return Segments == MySegments || Segments->Exited;
 }
 
 extern "C" void FinalizeMemHooks() {
+  // The writer drains rings under Lock, so stop it before appending the last
+  // blocks and the indices under Lock. They may not fit in the rings.
+  StopWriter();
   pthread_mutex_lock(&Lock);
-  for (size_t i = 0; i < LogFiles.size(); ++i) {
-    assert(LogFiles[i]);
-    fclose(LogFiles[i]);
+  for (size_t i = 0; i < LogBlocks.size(); ++i) {
+    if (IsClosable(LogBlocks[i]->Segments))
+      FlushLogBlock(LogBlocks[i]);
+  }
+  // Records logged from now on, e.g. by static destructors, would land after
+  // the index.
+  LogsClosed = true;
+  for (size_t i = 0; i < LogBlocks.size(); ++i)
+    LogBlocks[i]->FastEnd = 0;
+  // Streams have no index; the analyzer has already consumed the segments.
+  if (LogWriter != ShmWriter) {
+    for (size_t i = 0; i < AllLogSegments.size(); ++i) {
+      if (IsClosable(AllLogSegments[i]))
+        WriteLogIndex(AllLogSegments[i]);
+    }
+  }
+  // Draining is safe while the producer appends.
+  for (size_t i = 0; i < LogRings.size(); ++i)
+    DrainLogRing(LogRings[i]);
+  if (StreamArea) {
+    // Close the streams after their last bytes.
+    __sync_synchronize();
+    for (size_t i = 0; i < StreamRings.size(); ++i)
+      StreamRings[i]->Slot->State = LogStreamSlot::Closed;
+    __sync_fetch_and_sub(&StreamArea->NumProducers, 1);
+  }
+  // The logs of the running threads are left open. exit flushes their FILEs.
+  for (size_t i = 0; i < AllLogSegments.size(); ++i) {
+    LogSegments *Segments = AllLogSegments[i];
+    if (!IsClosable(Segments))
+      continue;
+    if (Segments->File)
+      fclose(Segments->File);
+    if (Segments->Ring)
+      close(Segments->Ring->FD);
+    if (Segments->Mapping) {
+      CloseLogWindow(Segments->Mapping);
+      close(Segments->Mapping->FD);
+    }
+    if (Segments->Uring) {
+      FlushLogUring(Segments->Uring);
+      close(Segments->Uring->FD);
+    }
+  }
+  if (LogWriter == RingWriter) {
+    unsigned long NumStalls = 0;
+    for (size_t i = 0; i < LogRings.size(); ++i)
+      NumStalls += LogRings[i]->NumStalls;
+    // NG_TELEMETRY counts the stalls of each thread as well.
+    if (NumStalls > 0) {
+      fprintf(stderr, "[ng] %lu ring stalls in %lu threads\n",
+              NumStalls, (unsigned long)LogRings.size());
+    }
+  }
+  if (NumDroppedRecords > 0) {
+    fprintf(stderr, "[ng] %lu records dropped in signal handlers\n",
+            NumDroppedRecords);
   }
   pthread_mutex_unlock(&Lock);
+  if (TelemetryEnabled)
+    Telemetry.dump();
 }
 
-extern "C" void InitMemHooks() {
+extern "C" void InitMemHooks(uint64_t Hash) {
+  ModuleHash = Hash;
   // Set the log directory name.
   if (const char *LogDirEnv = getenv("LOG_DIR")) {
     LogDirName = LogDirEnv;
@@ -89,92 +1272,526 @@ extern "C" void InitMemHooks() {
             LT->tm_hour, LT->tm_min, LT->tm_sec);
     LogDirName = LogDirNameCStr;
   }
-  // Craete the logging directory if doesn't exist.
-  int R = mkdir(LogDirName.c_str(), 0755);
-  if (R == -1) {
-    if (errno != EEXIST)
+  // Choose how records reach the log files.
+  if (const char *LogWriterEnv = getenv("LOG_WRITER")) {
+    if (strcmp(LogWriterEnv, "ring") == 0) {
+      LogWriter = RingWriter;
+    } else if (strcmp(LogWriterEnv, "mmap") == 0) {
+      LogWriter = MmapWriter;
+    } else if (strcmp(LogWriterEnv, "shm") == 0) {
+      LogWriter = ShmWriter;
+      const char *LogShmEnv = getenv("LOG_SHM");
+      LogShmName = (LogShmEnv ? LogShmEnv : "/neongoby");
+    } else if (strcmp(LogWriterEnv, "uring") == 0) {
+#ifdef NG_HAVE_IO_URING
+      LogWriter = UringWriter;
+#else
+      fprintf(stderr, "The memory hooks are built without io_uring\n");
       assert(false);
-    // Clear old log files in the log directory.
-    R = system(("rm -f " + LogDirName + "/pts-*").c_str());
-    assert(R != -1);
+#endif
+    } else if (strcmp(LogWriterEnv, "stdio") != 0) {
+      fprintf(stderr, "Unknown LOG_WRITER %s\n", LogWriterEnv);
+      assert(false);
+    }
+  }
+  if (const char *LogEncodingEnv = getenv("LOG_ENCODING")) {
+    if (strcmp(LogEncodingEnv, "delta") == 0) {
+      LogFlags |= LogFormat::DeltaEncoding;
+    } else if (strcmp(LogEncodingEnv, "plain") != 0) {
+      fprintf(stderr, "Unknown LOG_ENCODING %s\n", LogEncodingEnv);
+      assert(false);
+    }
   }
+  if (const char *LogCompressionEnv = getenv("LOG_COMPRESSION")) {
+    if (strcmp(LogCompressionEnv, "zstd") == 0) {
+#ifdef NG_HAVE_ZSTD
+      LogFlags |= LogFormat::Compressed;
+#else
+      fprintf(stderr, "The memory hooks are built without zstd\n");
+      assert(false);
+#endif
+    } else if (strcmp(LogCompressionEnv, "none") != 0) {
+      fprintf(stderr, "Unknown LOG_COMPRESSION %s\n", LogCompressionEnv);
+      assert(false);
+    }
+  }
+  if (const char *LogStampEnv = getenv("LOG_STAMP")) {
+    if (strcmp(LogStampEnv, "counter") == 0) {
+      LogStamp = CounterStamp;
+    } else if (strcmp(LogStampEnv, "tsc") == 0) {
+      LogStamp = TSCStamp;
+    } else if (strcmp(LogStampEnv, "none") != 0) {
+      fprintf(stderr, "Unknown LOG_STAMP %s\n", LogStampEnv);
+      assert(false);
+    }
+    if (const char *LogStampBatchEnv = getenv("LOG_STAMP_BATCH"))
+      LogStampBatch = max(strtoull(LogStampBatchEnv, NULL, 0), 1ULL);
+    if (LogStamp != NoStamp)
+      LogFlags |= LogFormat::Stamped;
+  }
+  // Sample TopLevel records, e.g. LOG_SAMPLE_WINDOW=10:100 logs them for
+  // 10 ms of every 100 ms.
+  if (const char *LogSampleWindowEnv = getenv("LOG_SAMPLE_WINDOW")) {
+    if (sscanf(LogSampleWindowEnv, "%u:%u",
+               &SampleWindowOn, &SampleWindowPeriod) != 2 ||
+        SampleWindowOn == 0 || SampleWindowOn > SampleWindowPeriod) {
+      fprintf(stderr, "Invalid LOG_SAMPLE_WINDOW %s\n", LogSampleWindowEnv);
+      assert(false);
+    }
+    // The window is always open.
+    if (SampleWindowOn == SampleWindowPeriod)
+      SampleWindowPeriod = 0;
+  }
+  if (const char *LogSampleRateEnv = getenv("LOG_SAMPLE_RATE"))
+    DefaultSampleRate = strtoul(LogSampleRateEnv, NULL, 0);
+  // e.g. LOG_SAMPLE_FUNCTIONS=12:100,34:0 logs one in 100 TopLevel records
+  // of function 12 and none of function 34.
+  if (const char *LogSampleFunctionsEnv = getenv("LOG_SAMPLE_FUNCTIONS")) {
+    istringstream IS(LogSampleFunctionsEnv);
+    string Item;
+    while (getline(IS, Item, ',')) {
+      unsigned FuncID, Rate;
+      if (sscanf(Item.c_str(), "%u:%u", &FuncID, &Rate) != 2) {
+        fprintf(stderr, "Invalid LOG_SAMPLE_FUNCTIONS %s\n",
+                LogSampleFunctionsEnv);
+        assert(false);
+      }
+      if (FuncID >= SampleRates.size())
+        SampleRates.resize(FuncID + 1, DefaultSampleRate);
+      SampleRates[FuncID] = Rate;
+    }
+  }
+  if (const char *LogDedupEnv = getenv("LOG_DEDUP"))
+    Dedup = (strcmp(LogDedupEnv, "0") != 0);
+  FilteringTopLevel = (Dedup || SampleWindowPeriod > 0 ||
+                       DefaultSampleRate != 1 || !SampleRates.empty());
+  if (const char *TelemetryEnv = getenv("NG_TELEMETRY"))
+    TelemetryEnabled = (strcmp(TelemetryEnv, "0") != 0);
+  if (const char *LogBlockSizeEnv = getenv("LOG_BLOCK_SIZE")) {
+    LogBlockSize = max((size_t)strtoul(LogBlockSizeEnv, NULL, 0),
+                       (size_t)LogFormat::MaxEncodedSize);
+  }
+  if (const char *LogStageSizeEnv = getenv("LOG_STAGE_SIZE")) {
+    LogStageSize = max((size_t)strtoul(LogStageSizeEnv, NULL, 0),
+                       (size_t)LogFormat::MaxEncodedSize);
+  }
+  if (const char *LogSegmentSizeEnv = getenv("LOG_SEGMENT_SIZE"))
+    LogSegmentSize = strtoul(LogSegmentSizeEnv, NULL, 0);
+  // A segment holds at least one record or block.
+  size_t MinSegmentSize = sizeof(LogSegmentHeader) + LogFormat::MaxEncodedSize;
+#ifdef NG_HAVE_ZSTD
+  if (LogFlags & LogFormat::Compressed) {
+    MinSegmentSize = max(MinSegmentSize,
+                         sizeof(LogSegmentHeader) + sizeof(LogBlockHeader) +
+                         ZSTD_compressBound(LogBlockSize));
+  }
+#endif
+  LogSegmentSize = max(LogSegmentSize, MinSegmentSize);
+  if (LogWriter == ShmWriter) {
+    if (LogFlags & LogFormat::Compressed) {
+      fprintf(stderr, "Streamed records cannot be compressed\n");
+      assert(false);
+    }
+    // A stream is one segment that never fills up.
+    LogSegmentSize = (size_t)-1 / 2;
+  }
+  if (const char *LogRingSizeEnv = getenv("LOG_RING_SIZE")) {
+    // Round up to a power of two.
+    size_t Size = max((size_t)strtoul(LogRingSizeEnv, NULL, 0),
+                      sizeof(LogFileHeader) + LogFormat::MaxEncodedSize);
+    for (LogRingSize = 1; LogRingSize < Size; LogRingSize *= 2);
+  }
+  if (const char *LogUringBufferSizeEnv = getenv("LOG_URING_BUFFER_SIZE")) {
+    // Round up to the alignment of O_DIRECT.
+    size_t Size = max((size_t)strtoul(LogUringBufferSizeEnv, NULL, 0),
+                      (size_t)1);
+    LogUringBufferSize = (Size + LogUringAlignment - 1) / LogUringAlignment *
+        LogUringAlignment;
+  }
+  if (const char *LogUringDepthEnv = getenv("LOG_URING_DEPTH"))
+    LogUringDepth = max((unsigned)strtoul(LogUringDepthEnv, NULL, 0), 1u);
+  if (const char *LogUringDirectEnv = getenv("LOG_URING_DIRECT"))
+    LogUringDirect = (strcmp(LogUringDirectEnv, "0") != 0);
+#ifdef NG_HAVE_IO_URING
+  if (LogWriter == UringWriter) {
+    // Kernels may lack io_uring or forbid it, e.g. in containers.
+    struct io_uring_params Params;
+    memset(&Params, 0, sizeof Params);
+    int RingFD = IoUringSetup(1, &Params);
+    if (RingFD == -1) {
+      fprintf(stderr, "[ng] io_uring is unavailable (%s); using stdio\n",
+              strerror(errno));
+      LogWriter = StdioWriter;
+    } else {
+      close(RingFD);
+    }
+  }
+#endif
+  if (const char *LogMmapChunkEnv = getenv("LOG_MMAP_CHUNK")) {
+    size_t PageSize = sysconf(_SC_PAGESIZE);
+    size_t Size = strtoul(LogMmapChunkEnv, NULL, 0);
+    LogMappingChunkSize = max((Size + PageSize - 1) / PageSize * PageSize,
+                              PageSize);
+  }
+  // Craete the logging directory if doesn't exist. Streaming needs it only
+  // for the telemetry.
+  if (LogWriter != ShmWriter || TelemetryEnabled) {
+    int R = mkdir(LogDirName.c_str(), 0755);
+    if (R == -1) {
+      if (errno != EEXIST)
+        assert(false);
+      // Clear old log files in the log directory.
+      R = system(("rm -f " + LogDirName + "/pts-* " +
+                  LogDirName + "/telemetry-*").c_str());
+      assert(R != -1);
+    }
+  }
+  if (LogWriter == ShmWriter)
+    OpenStreamArea();
+  if (TelemetryEnabled) {
+    SetTelemetryFileName();
+    HookTelemetry::InstallSignalHandler(SIGUSR2, DumpTelemetry,
+                                        &PreviousTelemetryAction);
+  }
+  int R = pthread_key_create(&MyLogKey, ReleaseMyLog);
+  assert(R == 0);
+  if (LogWriter == RingWriter)
+    StartWriter();
+  StartSampler();
   atexit(FinalizeMemHooks);
 }
 
-static void PrintLogRecord(const LogRecord &Record) {
-  // FIXME: Signal handler can happen anytime even if during the fwrite, causing
-  // the log to be broken. To workaround this issue, PrintLogRecord sets
-  // IsLogging at the beginning, and resets it at the end. If PrintLogRecord
-  // is entered with IsLogging on, the thread is probably inside a signal
-  // handler. In that case, we simply disable future logging. This approach is
-  // sure problematic because it misses logs, but it is not a big deal for now,
-  // because the signal is usually generated at the end of the execution when
-  // the user wants to terminate the server. A better approach would be to
-  // figure out statically which functions are signal handlers, and only disable
-  // logging inside the life cycles of these signal handlers.
-  if (IsLogging)
-    DisableLogging = true;
-  if (DisableLogging)
+static inline uint64_t GetStamp() {
+  switch (LogStamp) {
+    case NoStamp:
+      return 0;
+    case CounterStamp:
+      {
+        // A signal handler interrupting this may reuse the stamp, which is
+        // still no less than those logged before.
+        uint64_t Stamp = MyNextStamp;
+        if (Stamp == MyStampEnd) {
+          Stamp = __sync_fetch_and_add(&StampCounter, LogStampBatch);
+          MyStampEnd = Stamp + LogStampBatch;
+        }
+        MyNextStamp = Stamp + 1;
+        return Stamp;
+      }
+    case TSCStamp:
+      return HookTelemetry::ReadCycleCounter();
+  }
+  return 0;
+}
+
+// Decides whether to log the current TopLevel record.
+static bool SampleTopLevel() {
+  if (!SampleWindowOpen)
+    return false;
+  unsigned Rate = DefaultSampleRate;
+  if (NumSampledFrames > 0 && NumSampledFrames <= MaxNumSampledFrames) {
+    unsigned FuncID = SampledFrames[NumSampledFrames - 1];
+    if (FuncID < SampleRates.size())
+      Rate = SampleRates[FuncID];
+  }
+  if (Rate <= 1)
+    return Rate == 1;
+  // A xorshift generator is cheap and doesn't alias with periodic patterns in
+  // the program the way counting would.
+  if (SampleSeed == 0)
+    SampleSeed = syscall(SYS_gettid) | 1;
+  SampleSeed ^= SampleSeed << 13;
+  SampleSeed ^= SampleSeed >> 17;
+  SampleSeed ^= SampleSeed << 5;
+  return SampleSeed % Rate == 0;
+}
+
+static void AppendLogRecord(const LogRecord &Record, uint64_t Stamp) {
+  Count(Record.RecordType);
+  AppendToLogBlock(MyLogBlock, Record, Stamp);
+}
+
+// Makes the next <Length> bytes of the current thread's records go to the same
+// segment, by starting a new segment or block now if they don't fit.
+static void ReserveLogSpace(size_t Length) {
+  LogBlock *Block = MyLogBlock;
+  if (LogFlags & LogFormat::Compressed) {
+    if (Block->Size + Length > Block->Capacity)
+      FlushLogBlock(Block);
     return;
+  }
+  // The bytes the block's segment will hold once the block is appended.
+  LogSegments *Segments = Block->Segments;
+  size_t Used = (Segments->Used == 0 || Segments->Full ?
+                 sizeof(LogSegmentHeader) : Segments->Used) + Block->Size;
+  if (Used > sizeof(LogSegmentHeader) && Used + Length > LogSegmentSize) {
+    FlushLogBlock(Block);
+    if (!Segments->Full) {
+      EndLogSegment(Segments);
+      ResetLogBlock(Block);
+    }
+  } else if (Block->Size + Length > Block->End) {
+    FlushLogBlock(Block);
+  }
+}
 
-  IsLogging = true;
+// Appends the records queued by signal handlers, including those queued while
+// draining.
+static void DrainPendingRecords() {
+  unsigned NumDrained = 0;
+  while (true) {
+    CompilerBarrier();
+    unsigned NumPending = NumPendingRecords;
+    if (NumDrained == NumPending) {
+      // Fails if a handler reserves another slot in the meantime.
+      if (__sync_bool_compare_and_swap(&NumPendingRecords, NumPending, 0))
+        break;
+    } else if (NumDrained < MaxNumPendingRecords) {
+      AppendLogRecord(PendingRecords[NumDrained], PendingStamps[NumDrained]);
+      ++NumDrained;
+    } else {
+      // The records beyond MaxNumPendingRecords are dropped.
+      NumDrained = NumPending;
+    }
+  }
+}
+
+// Starts appending to the current thread's log. Signal handlers that log
+// until FinishAppending queue their records instead.
+static void StartAppending() {
+  LogDepth = 1;
+  CompilerBarrier();
   OpenLogFileIfNecessary();
-  size_t NumBytesWritten = fwrite(&Record, sizeof Record, 1, MyLogFile);
-  assert(NumBytesWritten == 1);
-  IsLogging = false;
+}
+
+// Appends the records queued by signal handlers, and finishes appending.
+static void FinishAppending() {
+  // Handlers may queue more records until LogDepth drops, so check again
+  // afterwards.
+  while (true) {
+    DrainPendingRecords();
+    CompilerBarrier();
+    LogDepth = 0;
+    CompilerBarrier();
+    if (NumPendingRecords == 0)
+      break;
+    LogDepth = 1;
+  }
+}
+
+// The destructor of MyLogKey. Flushes the current thread's block, which no
+// other thread may do while the thread runs. Records the thread logs from
+// now on, e.g. in later destructors, are queued and dropped.
+static void ReleaseMyLog(void *) {
+  if (LogsClosed || !MyLogBlock)
+    return;
+  StartAppending();
+  DrainPendingRecords();
+  FlushLogBlock(MyLogBlock);
+  if (MyLogUring)
+    FlushLogUring(MyLogUring);
+  pthread_mutex_lock(&Lock);
+  MySegments->Exited = true;
+  pthread_mutex_unlock(&Lock);
+}
+
+// The slow path of PrintLogRecord, which handles everything: opening the log,
+// flushing the block, signal handlers, telemetry, and closed logs.
+static void __attribute__((noinline)) PrintLogRecordSlow(
+    const LogRecord &Record) {
+  if (LogsClosed)
+    return;
+  // Stamp the record when it happens, even if it is queued.
+  uint64_t Stamp = GetStamp();
+  if (LogDepth > 0) {
+    // A signal handler interrupted PrintLogRecord on this thread. Reserve a
+    // slot atomically, because another handler may interrupt this one.
+    unsigned Slot = __sync_fetch_and_add(&NumPendingRecords, 1);
+    if (Slot < MaxNumPendingRecords) {
+      PendingRecords[Slot] = Record;
+      PendingStamps[Slot] = Stamp;
+    } else {
+      __sync_fetch_and_add(&NumDroppedRecords, 1);
+    }
+    return;
+  }
+
+  // Time one in HookTelemetry::TimingPeriod calls.
+  uint64_t Start = 0;
+  if (HookCounters *Counters = GetMyCounters()) {
+    if (++Counters->Counts[NumHookCallsCounter] %
+        HookTelemetry::TimingPeriod == 0)
+      Start = HookTelemetry::ReadCycleCounter();
+  }
+
+  StartAppending();
+  AppendLogRecord(Record, Stamp);
+  FinishAppending();
+  if (Start) {
+    Count(HookCyclesCounter, (HookTelemetry::ReadCycleCounter() - Start) *
+          HookTelemetry::TimingPeriod);
+  }
+}
+
+// The fast path of PrintLogRecord, small enough to be inlined into every hook
+// call site when the runtime's bitcode is linked into the program. Encodes
+// <Record> into the current thread's block if it has room and no signal
+// handler is logging, and returns whether it did.
+static inline bool PrintLogRecordFast(const LogRecord &Record) {
+  LogBlock *Block = MyLogBlock;
+  if (!Block || LogDepth > 0)
+    return false;
+  // Signal handlers queue their records meanwhile. Set before checking for
+  // room, so that no handler fills the room between the check and Encode.
+  LogDepth = 1;
+  CompilerBarrier();
+  if (Block->Size + LogFormat::MaxEncodedSize > Block->FastEnd) {
+    CompilerBarrier();
+    LogDepth = 0;
+    CompilerBarrier();
+    // PrintLogRecordSlow logs the records queued meanwhile.
+    return false;
+  }
+  uint64_t Stamp = GetStamp();
+  Block->Size += LogFormat::Encode(Record, Stamp, Block->Data + Block->Size,
+                                   LogFlags, Block->State);
+  ++Block->NumRecords;
+  CompilerBarrier();
+  LogDepth = 0;
+  CompilerBarrier();
+  if (NumPendingRecords > 0) {
+    LogDepth = 1;
+    FinishAppending();
+  }
+  return true;
+}
+
+static inline void PrintLogRecord(const LogRecord &Record) {
+  if (!PrintLogRecordFast(Record))
+    PrintLogRecordSlow(Record);
+}
+
+// Makes the next <Length> bytes of the current thread's records go to the same
+// segment. A best effort: records queued by signal handlers in the meantime
+// take space as well.
+static void ReserveMyLogSpace(size_t Length) {
+  if (LogsClosed || LogDepth > 0)
+    return;
+  StartAppending();
+  ReserveLogSpace(Length);
+  FinishAppending();
 }
 
 extern "C" void HookBeforeFork() {
-  // FIXME: MyLogFile can be empty if no log is written before forking.
+  // The analyzer keeps one call stack per stream and one version of each
+  // address for all of them. A child's stream would start in the middle of
+  // its parent's calls, and its addresses would clash with the parent's.
+  if (StreamArea) {
+    fprintf(stderr, "LOG_WRITER=shm does not support fork. "
+            "Log to files instead\n");
+    assert(false);
+  }
   // We assume there is only one running thread at the time of forking.
   // Therefore, we don't have to protect LogFiles through the entire forking
   // process.
-  for (size_t i = 0; i < LogFiles.size(); ++i) {
-    assert(LogFiles[i]);
-    fflush(LogFiles[i]);
+  // Write out everything the current thread logged so far, so that the
+  // child's log can refer to a prefix of its log on disk. The child has no
+  // other thread, and the other threads of the parent keep their blocks.
+  if (MyLogBlock)
+    FlushLogBlock(MyLogBlock);
+  if (MyLogFile)
+    fflush(MyLogFile);
+  // The writer thread drains all rings before it stops. It doesn't survive
+  // the fork anyway, so HookAfterFork restarts it in both processes.
+  StopWriter();
+  // Cut the preallocated tail so that the file size is the size of the log.
+  // The next record remaps the window.
+  if (MyLogMapping)
+    CloseLogWindow(MyLogMapping);
+  if (MyLogUring)
+    FlushLogUring(MyLogUring);
+  // The child's log continues the log of the thread calling fork, if any.
+  ForkParentLogName.clear();
+  if (MyLogFile || MyLogRing || MyLogMapping || MyLogUring) {
+    struct stat StatBuf;
+    int R = fstat(GetMyLogFD(), &StatBuf);
+    assert(R == 0);
+    ForkParentLogName = GetLogBaseName(syscall(SYS_gettid));
+    ForkParentLogSize = StatBuf.st_size;
+    ForkParentNumRecords = MySegments->NumRecords;
   }
-  assert(find(LogFiles.begin(), LogFiles.end(), MyLogFile) != LogFiles.end());
-  flock(fileno(MyLogFile), LOCK_EX);
 }
 
 extern "C" void HookAfterFork(int Result) {
   if (Result == 0) {
-    // child process: wait for copy to finish, then open the log file
-    assert(find(LogFiles.begin(), LogFiles.end(), MyLogFile) != LogFiles.end());
+    // child process: open a log file that refers to the parent's log
     for (size_t i = 0; i < LogFiles.size(); ++i) {
       assert(LogFiles[i]);
+      // The bytes other threads buffered are the parent's to write.
+      __fpurge(LogFiles[i]);
       fclose(LogFiles[i]);
     }
-
-    string ParentLogFileName = GetLogFileName(getppid());
-    FILE *ParentLogFile = fopen(ParentLogFileName.c_str(), "rb");
-    if (ParentLogFile) {
-      // TODO: in what situation would ParentLogFile be NULL? Should we fail
-      // somehow in this situation?
-      flock(fileno(ParentLogFile), LOCK_EX);
-      flock(fileno(ParentLogFile), LOCK_UN);
-      fclose(ParentLogFile);
+    for (size_t i = 0; i < LogRings.size(); ++i) {
+      close(LogRings[i]->FD);
+      delete LogRings[i];
+    }
+    // The windows of the parent's other threads are still mapped. Their files
+    // are the parent's, so they are not truncated.
+    for (size_t i = 0; i < LogMappings.size(); ++i) {
+      UnmapLogWindow(LogMappings[i]);
+      close(LogMappings[i]->FD);
+      delete LogMappings[i];
     }
+    // The writes of the parent's other threads are the parent's to wait for.
+    for (size_t i = 0; i < LogUrings.size(); ++i) {
+#ifdef NG_HAVE_IO_URING
+      TearDownLogUring(LogUrings[i]);
+#endif
+      close(LogUrings[i]->FD);
+      delete LogUrings[i];
+    }
+    // The current thread's block was flushed in HookBeforeFork, and the
+    // records in the others belong to the parent's threads.
+    for (size_t i = 0; i < LogBlocks.size(); ++i)
+      delete LogBlocks[i];
+    for (size_t i = 0; i < AllLogSegments.size(); ++i)
+      delete AllLogSegments[i];
 
     // The child process inherits LogFiles from the parent process, which are
     // no longer valid. Therefore, we clear them.
     // Grabbing the mutex here isn't necessary, because there should only be one
     // thread running right after the fork.
     LogFiles.clear();
-    // Although unlikely, DisableLogging may be set by the parent process. Reset
-    // it to false for this child process.
-    DisableLogging = false;
-    OpenLogFile(true);
-    assert(LogFiles.size() == 1);
-  } else {
-    // parent process: duplicate the log file, then unlock it
-    string ParentLogFileName = GetLogFileName();
-    string ChildLogFileName = GetLogFileName(Result);
-    string CmdLine = "cp " + ParentLogFileName + " " + ChildLogFileName;
-    int Ret = system(CmdLine.c_str());
-    assert(Ret == 0);
-    flock(fileno(MyLogFile), LOCK_UN);
+    LogRings.clear();
+    LogMappings.clear();
+    LogUrings.clear();
+    LogBlocks.clear();
+    AllLogSegments.clear();
+    MyLogFile = NULL;
+    MyLogRing = NULL;
+    MyLogMapping = NULL;
+    MyLogUring = NULL;
+    MyLogBlock = NULL;
+    MySegments = NULL;
+    // The child counts its own costs in its own telemetry file.
+    if (TelemetryEnabled) {
+      Telemetry.reset();
+      MyCounters = NULL;
+      SetTelemetryFileName();
+    }
+    // The child's own records start a new segment.
+    if (ForkParentLogName.empty()) {
+      OpenLogFile();
+    } else {
+      OpenLogFile(ForkParentLogName.c_str(), ForkParentLogSize,
+                  ForkParentNumRecords);
+    }
+    assert(LogFiles.size() + LogRings.size() + LogMappings.size() +
+           LogUrings.size() == 1);
+    // The sampler thread doesn't survive the fork either.
+    StartSampler();
   }
+  if (LogWriter == RingWriter)
+    StartWriter();
 }
 
 extern "C" void HookMemAlloc(unsigned ValueID,
@@ -182,6 +1799,8 @@ extern "C" void HookMemAlloc(unsigned ValueID,
                              unsigned long Bound) {
   // Bound is sometimes zero for array allocation.
   if (Bound > 0) {
+    if (Dedup)
+      __sync_fetch_and_add(&AllocEpoch, 1);
     LogRecord Record;
     Record.RecordType = LogRecord::MemAlloc;
     Record.MAR.Address = StartAddr;
@@ -191,6 +1810,80 @@ extern "C" void HookMemAlloc(unsigned ValueID,
   }
 }
 
+extern "C" void HookFrameAlloc(unsigned FuncID, void *Base,
+                               const FrameSlotLayout *Layout,
+                               unsigned NumSlots) {
+  if (Dedup)
+    __sync_fetch_and_add(&AllocEpoch, 1);
+  if (LogsClosed)
+    return;
+  // Keep the layout and the frame in the same segment.
+  ReserveMyLogSpace((NumSlots + 1) * LogFormat::MaxEncodedSize);
+  OpenLogFileIfNecessary();
+  vector<bool> &Logged = MySegments->LoggedFrameLayouts;
+  if (FuncID >= Logged.size())
+    Logged.resize(FuncID + 1, false);
+  if (!Logged[FuncID]) {
+    Logged[FuncID] = true;
+    for (unsigned i = 0; i < NumSlots; ++i) {
+      LogRecord Record;
+      Record.RecordType = LogRecord::FrameSlot;
+      Record.FSR.FunctionID = FuncID;
+      Record.FSR.Index = i;
+      Record.FSR.Offset = Layout[i].Offset;
+      Record.FSR.Bound = Layout[i].Bound;
+      Record.FSR.AllocatedBy = Layout[i].AllocatedBy;
+      PrintLogRecord(Record);
+    }
+  }
+  LogRecord Record;
+  Record.RecordType = LogRecord::FrameAlloc;
+  Record.FAR.FunctionID = FuncID;
+  Record.FAR.Base = Base;
+  PrintLogRecord(Record);
+}
+
+// Logs a hooked global with a GlobalAlloc record instead of a MemAlloc and a
+// TopLevel record. Each is logged once at startup, so neither LOG_DEDUP nor
+// sampling filters them.
+extern "C" void HookGlobalsAllocTable(const GlobalAllocEntry *Table,
+                                      unsigned NumGlobals) {
+  if (Dedup)
+    __sync_fetch_and_add(&AllocEpoch, 1);
+  for (unsigned i = 0; i < NumGlobals; ++i) {
+    const GlobalAllocEntry &Global = Table[i];
+    LogRecord Record;
+    if (Global.Hooked) {
+      Record.RecordType = LogRecord::GlobalAlloc;
+      Record.GAR.Address = Global.Address;
+      Record.GAR.Bound = Global.Bound;
+      Record.GAR.ValueID = Global.ValueID;
+    } else if (Global.Bound > 0) {
+      Record.RecordType = LogRecord::MemAlloc;
+      Record.MAR.Address = Global.Address;
+      Record.MAR.Bound = Global.Bound;
+      Record.MAR.AllocatedBy = Global.ValueID;
+    } else {
+      continue;
+    }
+    PrintLogRecord(Record);
+  }
+}
+
+extern "C" void HookMemFree(void *Address) {
+  // free(NULL) does nothing.
+  if (Address) {
+    // The analyses drop the points-to of the freed block, so repeated records
+    // of dangling pointers must be logged again.
+    if (Dedup)
+      __sync_fetch_and_add(&AllocEpoch, 1);
+    LogRecord Record;
+    Record.RecordType = LogRecord::MemFree;
+    Record.MFR.Address = Address;
+    PrintLogRecord(Record);
+  }
+}
+
 extern "C" void HookMainArgsAlloc(int Argc, char *Argv[],
                                   unsigned ArgvValueID) {
   HookMemAlloc(ArgvValueID, Argv, Argc * sizeof(char *));
@@ -198,7 +1891,36 @@ extern "C" void HookMainArgsAlloc(int Argc, char *Argv[],
     HookMemAlloc(-1, Argv[i], strlen(Argv[i]) + 1); // ends with '\0'
 }
 
+// Decides whether to log a TopLevel record with LOG_DEDUP or sampling.
+static bool __attribute__((noinline)) FilterTopLevel(void *Value,
+                                                     void *Pointer,
+                                                     unsigned ValueID) {
+  DedupEntry *Entry = NULL;
+  if (Dedup) {
+    // Each pointer has at most one entry, its last logged value. Fibonacci
+    // hashing spreads the nearby IDs a loop produces.
+    Entry = &DedupCache[(ValueID * 2654435761u) >> 24];
+    if (Entry->ValueID == ValueID && Entry->PointeeAddress == Value &&
+        Entry->LoadedFrom == Pointer && Entry->Epoch == MyDedupEpoch &&
+        Entry->AllocEpoch == AllocEpoch)
+      return false;
+  }
+  if (!SampleTopLevel())
+    return false;
+  if (Entry) {
+    // Only cache records that are logged.
+    Entry->ValueID = ValueID;
+    Entry->PointeeAddress = Value;
+    Entry->LoadedFrom = Pointer;
+    Entry->Epoch = MyDedupEpoch;
+    Entry->AllocEpoch = AllocEpoch;
+  }
+  return true;
+}
+
 extern "C" void HookTopLevel(void *Value, void *Pointer, unsigned ValueID) {
+  if (FilteringTopLevel && !FilterTopLevel(Value, Pointer, ValueID))
+    return;
   LogRecord Record;
   Record.RecordType = LogRecord::TopLevel;
   Record.TLR.PointerValueID = ValueID;
@@ -207,7 +1929,40 @@ extern "C" void HookTopLevel(void *Value, void *Pointer, unsigned ValueID) {
   PrintLogRecord(Record);
 }
 
+// HookTopLevel for the profiles whose analyses don't read LoadedFrom.
+extern "C" void HookTopLevelValue(void *Value, unsigned ValueID) {
+  HookTopLevel(Value, NULL, ValueID);
+}
+
+// Logs the pointers of a basic block MemoryInstrumenter batched with
+// -batch-hooks. <Pointers> has the pointee address and the LoadedFrom of each
+// pointer, and <ValueIDs> is the block's static table of their value IDs.
+extern "C" void HookTopLevelBatch(const unsigned *ValueIDs,
+                                  void *const *Pointers,
+                                  unsigned NumPointers) {
+  for (unsigned i = 0; i < NumPointers; ++i)
+    HookTopLevel(Pointers[2 * i], Pointers[2 * i + 1], ValueIDs[i]);
+}
+
+// HookTopLevelBatch for -drop-ignored-records, which doesn't log NULLs.
+extern "C" void HookTopLevelBatchNonNull(const unsigned *ValueIDs,
+                                         void *const *Pointers,
+                                         unsigned NumPointers) {
+  for (unsigned i = 0; i < NumPointers; ++i) {
+    if (Pointers[2 * i])
+      HookTopLevel(Pointers[2 * i], Pointers[2 * i + 1], ValueIDs[i]);
+  }
+}
+
 extern "C" void HookEnter(unsigned FuncID) {
+  ++MyDedupEpoch;
+  if (!SampleRates.empty()) {
+    // Reserve the frame before filling it, in case a signal handler enters a
+    // function in between.
+    unsigned Depth = NumSampledFrames++;
+    if (Depth < MaxNumSampledFrames)
+      SampledFrames[Depth] = FuncID;
+  }
   LogRecord Record;
   Record.RecordType = LogRecord::Enter;
   Record.ER.FunctionID = FuncID;
@@ -237,6 +1992,9 @@ extern "C" void HookReturn(unsigned FuncID, unsigned InsID) {
   Record.RR.FunctionID = FuncID;
   Record.RR.InstructionID = InsID;
   PrintLogRecord(Record);
+  ++MyDedupEpoch;
+  if (!SampleRates.empty() && NumSampledFrames > 0)
+    --NumSampledFrames;
 }
 
 extern "C" void HookBasicBlock(unsigned ValueID) {
@@ -0,0 +1,446 @@
+// vim: sw=2
+
+// Checks that LogFormat decodes what it encodes: every record type under
+// every combination of the header flags, with the codec state carried across
+// records, truncated records rejected without touching the state, and
+// segmented logs whose index agrees with their segments. Logs written by the
+// memory hooks, e.g. LOG_DIR/pts-*, can be given as arguments to cross-check
+// their segments and indexes as well.
+//
+// Returns 0 if all checks pass.
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "dyn-aa/LogFormat.h"
+
+using namespace std;
+using namespace neongoby;
+
+static unsigned NumFailures = 0;
+// Set while a check is expected to fail.
+static bool Quiet = false;
+
+#define CHECK(Cond, ...)                                                  \
+  do {                                                                    \
+    if (!(Cond)) {                                                        \
+      if (!Quiet) {                                                       \
+        fprintf(stderr, "%s:%d: %s failed: ", __FILE__, __LINE__, #Cond); \
+        fprintf(stderr, __VA_ARGS__);                                     \
+        fprintf(stderr, "\n");                                            \
+      }                                                                   \
+      ++NumFailures;                                                      \
+    }                                                                     \
+  } while (false)
+
+static void *Addr(uint64_t A) {
+  return (void *)(uintptr_t)A;
+}
+
+// Fills the fields of a record of <Type> from <Values>, so that the same
+// pattern of values exercises every field of every type.
+static LogRecord MakeRecord(LogRecord::LogRecordType Type,
+                            const uint64_t Values[5]) {
+  LogRecord Record;
+  memset(&Record, 0, sizeof Record);
+  Record.RecordType = Type;
+  switch (Type) {
+    case LogRecord::MemAlloc:
+      Record.MAR.Address = Addr(Values[0]);
+      Record.MAR.Bound = Values[1];
+      Record.MAR.AllocatedBy = Values[2];
+      break;
+    case LogRecord::TopLevel:
+      Record.TLR.PointerValueID = Values[2];
+      Record.TLR.PointeeAddress = Addr(Values[0]);
+      Record.TLR.LoadedFrom = Addr(Values[1]);
+      break;
+    case LogRecord::Enter:
+      Record.ER.FunctionID = Values[2];
+      break;
+    case LogRecord::Store:
+      Record.SR.PointerAddress = Addr(Values[1]);
+      Record.SR.PointeeAddress = Addr(Values[0]);
+      Record.SR.InstructionID = Values[2];
+      break;
+    case LogRecord::Call:
+      Record.CR.InstructionID = Values[2];
+      break;
+    case LogRecord::Return:
+      Record.RR.FunctionID = Values[2];
+      Record.RR.InstructionID = Values[3];
+      break;
+    case LogRecord::BasicBlock:
+      Record.BBR.ValueID = Values[2];
+      break;
+    case LogRecord::FrameSlot:
+      Record.FSR.FunctionID = Values[2];
+      Record.FSR.Index = Values[3];
+      Record.FSR.Offset = Values[4];
+      Record.FSR.Bound = Values[1];
+      Record.FSR.AllocatedBy = Values[3] ^ Values[4];
+      break;
+    case LogRecord::FrameAlloc:
+      Record.FAR.FunctionID = Values[2];
+      Record.FAR.Base = Addr(Values[0]);
+      break;
+    case LogRecord::MemFree:
+      Record.MFR.Address = Addr(Values[0]);
+      break;
+    case LogRecord::GlobalAlloc:
+      Record.GAR.Address = Addr(Values[0]);
+      Record.GAR.Bound = Values[1];
+      Record.GAR.ValueID = Values[2];
+      break;
+  }
+  return Record;
+}
+
+static bool SameRecord(const LogRecord &A, const LogRecord &B) {
+  return A.RecordType == B.RecordType &&
+      memcmp(&A.MAR, &B.MAR, LogFormat::GetPayloadSize(A.RecordType)) == 0;
+}
+
+static bool SameState(const LogCodecState &A, const LogCodecState &B) {
+  return memcmp(&A, &B, sizeof A) == 0;
+}
+
+// The records and stamps of a synthetic trace: every type with NULLs, small
+// values, the largest values, and steps back, so that the deltas are zero,
+// positive, negative and as wide as they get.
+static void MakeTrace(vector<LogRecord> &Records, vector<uint64_t> &Stamps) {
+  static const uint64_t Patterns[][5] = {
+    {0, 0, 0, 0, 0},
+    {0x1000, 8, 1, 2, 3},
+    {0x1008, 16, 2, 1, 0},
+    {0x7fffffffe000ULL, 4096, 100000, 7, 64},
+    {0x1000, 8, 1, 2, 3},
+    {UINTPTR_MAX, (unsigned long)-1, 0xffffffffu, 0xffffffffu, 0xffffffffu},
+    {1, 1, 0xfffffffeu, 0, 1},
+    {0x601040, 24, 12345, 5, 40}
+  };
+  static const uint64_t StampSteps[] = {
+    0, 1, 1024, (uint64_t)-1, 3, 1ULL << 40, 0, 7
+  };
+  const size_t NumPatterns = sizeof Patterns / sizeof Patterns[0];
+  uint64_t Stamp = 0;
+  for (size_t i = 0; i < NumPatterns; ++i) {
+    for (unsigned Type = 0; Type < LogFormat::NumRecordTypes; ++Type) {
+      Records.push_back(MakeRecord((LogRecord::LogRecordType)Type,
+                                   Patterns[i]));
+      Stamp += StampSteps[(i + Type) % NumPatterns];
+      Stamps.push_back(Stamp);
+    }
+  }
+}
+
+// Encodes the trace with one codec state and decodes it with another, as a
+// thread's log is written and read, checking each record and stamp.
+static void CheckRoundTrip(uint16_t Flags) {
+  vector<LogRecord> Records;
+  vector<uint64_t> Stamps;
+  MakeTrace(Records, Stamps);
+
+  vector<char> Log;
+  LogCodecState EncodeState = LogCodecState();
+  for (size_t i = 0; i < Records.size(); ++i) {
+    char Buffer[LogFormat::MaxEncodedSize];
+    size_t Size = LogFormat::Encode(Records[i], Stamps[i], Buffer, Flags,
+                                    EncodeState);
+    CHECK(Size > 0 && Size <= LogFormat::MaxEncodedSize,
+          "flags %u, record %zu takes %zu bytes", Flags, i, Size);
+    Log.insert(Log.end(), Buffer, Buffer + Size);
+  }
+
+  LogCodecState DecodeState = LogCodecState();
+  size_t Offset = 0;
+  for (size_t i = 0; i < Records.size(); ++i) {
+    LogRecord Record;
+    uint64_t Stamp;
+    size_t Size = LogFormat::Decode(&Log[Offset], Log.size() - Offset, Record,
+                                    Stamp, Flags, DecodeState);
+    CHECK(Size > 0, "flags %u, record %zu is not decoded", Flags, i);
+    if (Size == 0)
+      return;
+    CHECK(SameRecord(Record, Records[i]),
+          "flags %u, record %zu of type %u differs", Flags, i,
+          (unsigned)Records[i].RecordType);
+    uint64_t Expected = (Flags & LogFormat::Stamped) ? Stamps[i] : 0;
+    CHECK(Stamp == Expected, "flags %u, record %zu has stamp %llu, not %llu",
+          Flags, i, (unsigned long long)Stamp,
+          (unsigned long long)Expected);
+    Offset += Size;
+  }
+  CHECK(Offset == Log.size(), "flags %u, %zu bytes left", Flags,
+        Log.size() - Offset);
+  CHECK(SameState(EncodeState, DecodeState),
+        "flags %u, the encoder and the decoder end in different states",
+        Flags);
+}
+
+// Every proper prefix of an encoded record is rejected and leaves the codec
+// state as it was, so that a reader can wait for the rest of the record.
+static void CheckTruncation(uint16_t Flags) {
+  vector<LogRecord> Records;
+  vector<uint64_t> Stamps;
+  MakeTrace(Records, Stamps);
+
+  LogCodecState EncodeState = LogCodecState();
+  LogCodecState DecodeState = LogCodecState();
+  for (size_t i = 0; i < Records.size(); ++i) {
+    char Buffer[LogFormat::MaxEncodedSize];
+    size_t Size = LogFormat::Encode(Records[i], Stamps[i], Buffer, Flags,
+                                    EncodeState);
+    for (size_t Prefix = 0; Prefix < Size; ++Prefix) {
+      LogCodecState Before = DecodeState;
+      LogRecord Record;
+      uint64_t Stamp;
+      CHECK(LogFormat::Decode(Buffer, Prefix, Record, Stamp, Flags,
+                              DecodeState) == 0,
+            "flags %u, record %zu is decoded from %zu of its %zu bytes",
+            Flags, i, Prefix, Size);
+      CHECK(SameState(Before, DecodeState),
+            "flags %u, a truncated record %zu changes the state", Flags, i);
+    }
+    LogRecord Record;
+    uint64_t Stamp;
+    CHECK(LogFormat::Decode(Buffer, Size, Record, Stamp, Flags,
+                            DecodeState) == Size,
+          "flags %u, record %zu is not decoded after its prefixes", Flags, i);
+  }
+
+  // Zero padding and unknown tags are not records either.
+  char Padding[LogFormat::MaxEncodedSize];
+  memset(Padding, 0, sizeof Padding);
+  LogRecord Record;
+  uint64_t Stamp;
+  CHECK(LogFormat::Decode(Padding, sizeof Padding, Record, Stamp, Flags,
+                          DecodeState) == 0,
+        "flags %u, padding is decoded", Flags);
+  Padding[0] = (char)(LogFormat::NumRecordTypes + 1);
+  CHECK(LogFormat::Decode(Padding, sizeof Padding, Record, Stamp, Flags,
+                          DecodeState) == 0,
+        "flags %u, an unknown tag is decoded", Flags);
+}
+
+// Checks the segments of the log in <Log> against its index, if it has one.
+// Segments start at <Begin> at fixed strides, each decodes on its own, and
+// each starts with the number of records before it. <Name> is for messages.
+static void CheckSegments(const string &Name, const vector<char> &Log,
+                          size_t Begin, uint16_t Flags) {
+  size_t DataEnd = Log.size();
+  vector<LogSegmentIndexEntry> Index;
+  LogIndexTrailer Trailer;
+  bool HasIndex = false;
+  if (Log.size() >= Begin + sizeof Trailer) {
+    memcpy(&Trailer, &Log[Log.size() - sizeof Trailer], sizeof Trailer);
+    if (LogFormat::IsValidIndexTrailer(Trailer) &&
+        Trailer.NumSegments <= (Log.size() - Begin - sizeof Trailer) /
+            sizeof(LogSegmentIndexEntry)) {
+      HasIndex = true;
+      DataEnd = Log.size() - sizeof Trailer -
+          Trailer.NumSegments * sizeof(LogSegmentIndexEntry);
+      Index.resize(Trailer.NumSegments);
+      if (!Index.empty()) {
+        memcpy(&Index[0], &Log[DataEnd],
+               Index.size() * sizeof(LogSegmentIndexEntry));
+      }
+    }
+  }
+
+  size_t NumSegments = 0;
+  uint64_t NextRecordID = 0;
+  for (size_t Offset = Begin; Offset + sizeof(LogSegmentHeader) <= DataEnd;
+       ++NumSegments) {
+    LogSegmentHeader Header;
+    memcpy(&Header, &Log[Offset], sizeof Header);
+    CHECK(LogFormat::IsValidSegmentHeader(Header),
+          "%s has a broken segment at offset %zu", Name.c_str(), Offset);
+    if (!LogFormat::IsValidSegmentHeader(Header))
+      return;
+    if (NumSegments < Index.size()) {
+      CHECK(Index[NumSegments].Offset == Offset,
+            "%s indexes segment %zu at offset %llu, not %zu", Name.c_str(),
+            NumSegments, (unsigned long long)Index[NumSegments].Offset,
+            Offset);
+      CHECK(Index[NumSegments].FirstRecordID == Header.FirstRecordID,
+            "%s indexes segment %zu from record %llu, not %llu",
+            Name.c_str(), NumSegments,
+            (unsigned long long)Index[NumSegments].FirstRecordID,
+            (unsigned long long)Header.FirstRecordID);
+    }
+    // The first segment of a forked child's log continues its parent's.
+    if (NumSegments > 0) {
+      CHECK(Header.FirstRecordID == NextRecordID,
+            "%s segment %zu starts from record %llu, not %llu", Name.c_str(),
+            NumSegments, (unsigned long long)Header.FirstRecordID,
+            (unsigned long long)NextRecordID);
+    }
+    NextRecordID = Header.FirstRecordID;
+
+    size_t End = min(DataEnd, (size_t)(Offset + Header.Capacity));
+    if (!(Flags & LogFormat::Compressed)) {
+      // A fresh state per segment, and nothing but padding after the last
+      // record.
+      LogCodecState State = LogCodecState();
+      size_t P = Offset + sizeof Header;
+      LogRecord Record;
+      uint64_t Stamp;
+      while (size_t Size = LogFormat::Decode(&Log[P], End - P, Record, Stamp,
+                                             Flags, State)) {
+        P += Size;
+        ++NextRecordID;
+      }
+      for (; P < End; ++P) {
+        CHECK(Log[P] == 0, "%s segment %zu has garbage at offset %zu",
+              Name.c_str(), NumSegments, P);
+        if (Log[P] != 0)
+          break;
+      }
+    }
+    Offset += Header.Capacity;
+  }
+  if (HasIndex) {
+    CHECK(NumSegments == Index.size(), "%s has %zu segments but indexes %zu",
+          Name.c_str(), NumSegments, Index.size());
+  }
+}
+
+// Lays the trace out as the memory hooks do: a LogFileHeader, segments of
+// <Capacity> bytes that records never span, and the index. Then checks it.
+static void CheckSegmentedLog(uint16_t Flags, uint64_t Capacity) {
+  vector<LogRecord> Records;
+  vector<uint64_t> Stamps;
+  MakeTrace(Records, Stamps);
+
+  vector<char> Log;
+  LogFileHeader FileHeader;
+  LogFormat::InitHeader(FileHeader, Flags);
+  Log.insert(Log.end(), (char *)&FileHeader,
+             (char *)&FileHeader + sizeof FileHeader);
+
+  vector<LogSegmentIndexEntry> Index;
+  LogCodecState State = LogCodecState();
+  size_t SegmentEnd = Log.size();
+  for (size_t i = 0; i < Records.size(); ++i) {
+    char Buffer[LogFormat::MaxEncodedSize];
+    LogCodecState NewState = State;
+    size_t Size = LogFormat::Encode(Records[i], Stamps[i], Buffer, Flags,
+                                    NewState);
+    if (Index.empty() || Log.size() + Size > SegmentEnd) {
+      // Pad the current segment, and start a new one with a fresh state.
+      Log.resize(SegmentEnd, 0);
+      LogSegmentIndexEntry Entry;
+      Entry.Offset = Log.size();
+      Entry.FirstRecordID = i;
+      Index.push_back(Entry);
+      LogSegmentHeader Header;
+      LogFormat::InitSegmentHeader(Header, 1, 0x1234, i, Capacity);
+      Log.insert(Log.end(), (char *)&Header, (char *)&Header + sizeof Header);
+      SegmentEnd = Entry.Offset + Capacity;
+      State = LogCodecState();
+      NewState = State;
+      Size = LogFormat::Encode(Records[i], Stamps[i], Buffer, Flags,
+                               NewState);
+    }
+    Log.insert(Log.end(), Buffer, Buffer + Size);
+    State = NewState;
+  }
+  // The last segment ends where the log ends.
+  Log.insert(Log.end(), (char *)&Index[0],
+             (char *)&Index[0] + Index.size() * sizeof Index[0]);
+  LogIndexTrailer Trailer;
+  LogFormat::InitIndexTrailer(Trailer, Index.size());
+  Log.insert(Log.end(), (char *)&Trailer, (char *)&Trailer + sizeof Trailer);
+
+  char Name[64];
+  snprintf(Name, sizeof Name, "a log with flags %u", Flags);
+  CHECK(Index.size() > 1, "%s fits in one segment of %llu bytes", Name,
+        (unsigned long long)Capacity);
+  if (Index.size() <= 1)
+    return;
+  CheckSegments(Name, Log, sizeof FileHeader, Flags);
+
+  // A log without its index, e.g. of a crashed program, still has its
+  // segments.
+  Log.resize(Log.size() - sizeof Trailer - Index.size() * sizeof Index[0]);
+  CheckSegments(Name, Log, sizeof FileHeader, Flags);
+
+  // An index that disagrees with the segments is caught.
+  unsigned OldNumFailures = NumFailures;
+  Index[1].FirstRecordID += 1;
+  Log.insert(Log.end(), (char *)&Index[0],
+             (char *)&Index[0] + Index.size() * sizeof Index[0]);
+  Log.insert(Log.end(), (char *)&Trailer, (char *)&Trailer + sizeof Trailer);
+  Quiet = true;
+  CheckSegments(Name, Log, sizeof FileHeader, Flags);
+  Quiet = false;
+  CHECK(NumFailures > OldNumFailures, "%s has a broken index unnoticed",
+        Name);
+  NumFailures = OldNumFailures;
+}
+
+// Cross-checks the segments and the index of a log written by the memory
+// hooks.
+static void CheckLogFile(const char *FileName) {
+  FILE *LogFile = fopen(FileName, "rb");
+  CHECK(LogFile, "cannot open %s", FileName);
+  if (!LogFile)
+    return;
+  vector<char> Log;
+  char Buffer[65536];
+  while (size_t N = fread(Buffer, 1, sizeof Buffer, LogFile))
+    Log.insert(Log.end(), Buffer, Buffer + N);
+  fclose(LogFile);
+
+  LogFileHeader Header;
+  CHECK(Log.size() >= sizeof Header, "%s has no header", FileName);
+  if (Log.size() < sizeof Header)
+    return;
+  memcpy(&Header, &Log[0], sizeof Header);
+  CHECK(LogFormat::IsValidHeader(Header) &&
+        Header.Version >= LogFormat::FirstSegmentedVersion,
+        "%s is not a segmented log", FileName);
+  if (!LogFormat::IsValidHeader(Header) ||
+      Header.Version < LogFormat::FirstSegmentedVersion)
+    return;
+  size_t Begin = sizeof Header;
+  if (Header.Flags & LogFormat::Forked) {
+    LogParentRef Parent;
+    CHECK(Log.size() >= Begin + sizeof Parent, "%s has no parent reference",
+          FileName);
+    if (Log.size() < Begin + sizeof Parent)
+      return;
+    memcpy(&Parent, &Log[Begin], sizeof Parent);
+    Begin += sizeof Parent + Parent.NameLength;
+  }
+  CheckSegments(FileName, Log, Begin, Header.Flags);
+}
+
+int main(int argc, char *argv[]) {
+  // Compressed and Forked change how records are laid out around the codec,
+  // not the codec itself, so the codec must ignore them.
+  for (uint16_t Flags = 0; Flags < 16; ++Flags) {
+    CheckRoundTrip(Flags);
+    CheckTruncation(Flags);
+    if (!(Flags & (LogFormat::Compressed | LogFormat::Forked))) {
+      CheckSegmentedLog(Flags, sizeof(LogSegmentHeader) + 64);
+      CheckSegmentedLog(Flags, sizeof(LogSegmentHeader) +
+                        LogFormat::MaxEncodedSize);
+    }
+  }
+  for (int i = 1; i < argc; ++i)
+    CheckLogFile(argv[i]);
+
+  if (NumFailures > 0) {
+    fprintf(stderr, "%u checks failed\n", NumFailures);
+    return 1;
+  }
+  fprintf(stderr, "All checks passed\n");
+  return 0;
+}
@@ -0,0 +1,33 @@
+; -elide-local-allocas must still log %x, which main passes to @f, even though
+; @f doesn't capture it: @f hooks %a and %b, and only a logged %x gives them a
+; version. %y is only cleared by memset, so it is never hooked.
+;
+;   llvm-as TestLocalAllocaCall.ll
+;   ng_hook_mem.py --elide-local=all TestLocalAllocaCall
+;   llvm-dis TestLocalAllocaCall.inst.bc
+;
+; hooks the allocation of %x with HookMemAlloc, but not that of %y.
+; ModuleID = 'TestLocalAllocaCall.c'
+target datalayout = "e-p:64:64:64-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-s0:64:64-f80:128:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+define i32 @f(i32* nocapture %a, i32* nocapture %b) nounwind uwtable readonly {
+entry:
+  %0 = load i32* %a, align 4
+  %1 = load i32* %b, align 4
+  %add = add nsw i32 %1, %0
+  ret i32 %add
+}
+
+define i32 @main() nounwind uwtable {
+entry:
+  %x = alloca i32, align 4
+  %y = alloca [16 x i8], align 16
+  store i32 1, i32* %x, align 4
+  %call = call i32 @f(i32* %x, i32* %x)
+  %arraydecay = getelementptr inbounds [16 x i8]* %y, i64 0, i64 0
+  call void @llvm.memset.p0i8.i64(i8* %arraydecay, i8 0, i64 16, i32 16, i1 false)
+  ret i32 %call
+}
+
+declare void @llvm.memset.p0i8.i64(i8* nocapture, i8, i64, i32, i1) nounwind
@@ -15,9 +15,16 @@ using namespace llvm;
 using namespace rcs;
 using namespace neongoby;
 
+static cl::opt<unsigned long long> StartRecord(
+    "start-record",
+    cl::desc("Dump each log from the record with this ID, skipping the "
+             "segments before it"),
+    cl::init(0));
+
 int main(int argc, char *argv[]) {
   cl::ParseCommandLineOptions(argc, argv, "Dumps point-to logs");
   LogDumper LD;
+  LD.setStartRecord(StartRecord);
   LD.processLog();
   return 0;
 }
@@ -41,6 +41,9 @@ if __name__ == '__main__':
                         metavar = 'baseline_aa',
                         default = 'no-aa',
                         choices = ['no-aa', 'basicaa', 'tbaa'])
+    parser.add_argument('--derivations',
+                        help = 'the derivations written by ' + \
+                               'ng_hook_mem.py --elide-derived')
     args = parser.parse_args()
 
     cmd = ng_utils.load_all_plugins('opt')
@@ -69,6 +72,8 @@ if __name__ == '__main__':
     cmd = ' '.join((cmd, '-check-aa'))
     for log in args.logs:
         cmd = ' '.join((cmd, '-log-file', log))
+    if args.derivations is not None:
+        cmd = ' '.join((cmd, '-derivations', args.derivations))
     if args.output_ng:
         cmd = ' '.join((cmd, '-output-ng', '/tmp/ng'))
     if args.check_all or args.root_only:
@@ -1,6 +1,7 @@
 #!/usr/bin/env python
 
 import argparse
+import sys
 import rcs_utils
 import ng_utils
 
@@ -17,12 +18,115 @@ if __name__ == '__main__':
                                'trace slicing (False by default)',
                         action = 'store_true',
                         default = False)
+    parser.add_argument('--profile',
+                        help = 'log only what these analyses read: ' + \
+                               'full (default), check-aa, check-cg, or ' + \
+                               'diagnose (the same as --diagnose)',
+                        default = 'full',
+                        choices = ['full', 'check-aa', 'check-cg',
+                                   'diagnose'])
+    parser.add_argument('--drop-ignored',
+                        help = 'log no NULL pointers, bitcasts or PHI ' + \
+                               'nodes, which ng_check_aa.py ignores ' + \
+                               '(False by default)',
+                        action = 'store_true',
+                        default = False)
+    parser.add_argument('--elide-local',
+                        help = 'log no allocas that never escape their ' + \
+                               'functions, or pointers into them, for an ' + \
+                               'AA that decides their aliases ' + \
+                               'intra-procedurally: none (default), ' + \
+                               'direct, constant-offset, or all, by how ' + \
+                               'the pointers into them may be derived',
+                        default = 'none',
+                        choices = ['none', 'direct', 'constant-offset',
+                                   'all'])
+    parser.add_argument('--coalesce-frames',
+                        help = 'log the entry-block allocas of a ' + \
+                               'function with one record, moving them ' + \
+                               'into one frame (False by default)',
+                        action = 'store_true',
+                        default = False)
+    parser.add_argument('--global-table',
+                        help = 'log the global variables and functions ' + \
+                               'from one table, with one record each ' + \
+                               'instead of two (False by default)',
+                        action = 'store_true',
+                        default = False)
+    parser.add_argument('--zstd',
+                        help = 'link libzstd, which the memory hooks need ' + \
+                               'if built with USE_ZSTD=1 (False by default)',
+                        action = 'store_true',
+                        default = False)
+    parser.add_argument('--inline-hooks',
+                        help = 'link the bitcode of the memory hooks into ' + \
+                               'the program before codegen, so that their ' + \
+                               'fast paths are inlined (False by default)',
+                        action = 'store_true',
+                        default = False)
+    parser.add_argument('--elide-derived',
+                        help = 'skip hooking pointers at constant offsets ' + \
+                               'from logged pointers, and write their ' + \
+                               'derivations to <prog>.derivations for ' + \
+                               'the checkers (False by default)',
+                        action = 'store_true',
+                        default = False)
+    parser.add_argument('--hoist-invariant',
+                        help = 'hook pointers that stay the same ' + \
+                               'throughout a loop once before the loop ' + \
+                               '(False by default)',
+                        action = 'store_true',
+                        default = False)
+    parser.add_argument('--batch-hooks',
+                        help = 'hook the pointers of a basic block with ' + \
+                               'one call (False by default)',
+                        action = 'store_true',
+                        default = False)
+    parser.add_argument('--selective',
+                        help = 'only hook the pointers in the alias ' + \
+                               'checks the online mode would add for this ' + \
+                               'AA: ' + str(ng_utils.get_aa_choices()),
+                        metavar = 'aa',
+                        choices = ng_utils.get_aa_choices())
+    # Due to the behavior of LLVM's alias analysis chaining, the baseline AA
+    # must be an ImmutablePass.
+    parser.add_argument('--baseline',
+                        help = 'AA which is assumed to be correct, used ' + \
+                               'by --elide-derived and --hoist-invariant ' + \
+                               'to find unmodified locations, and by ' + \
+                               '--selective to find the alias checks',
+                        metavar = 'baseline_aa',
+                        default = 'basicaa',
+                        choices = ['no-aa', 'basicaa', 'tbaa'])
     args = parser.parse_args()
 
     instrumented_bc = args.prog + '.inst.bc'
     instrumented_exe = args.prog + '.inst'
 
+    if args.selective is not None:
+        if args.baseline == args.selective:
+            sys.stderr.write('\033[0;31m')
+            print >> sys.stderr, 'Error: Baseline and the checked AA',
+            print >> sys.stderr, 'must be different'
+            sys.stderr.write('\033[m')
+            sys.exit(1)
+        # Compute the alias checks as ng_insert_alias_checker.py would.
+        alias_checks = args.prog + '.checks'
+        cmd = ng_utils.load_all_plugins('opt')
+        cmd = ng_utils.load_aa(cmd, args.baseline)
+        cmd = ' '.join((cmd, '-baseline-aa'))
+        cmd = ' '.join((cmd, '-baseline-aa-name', args.baseline))
+        cmd = ng_utils.load_aa(cmd, args.selective)
+        cmd = ' '.join((cmd, '-instrument-alias-checker'))
+        cmd = ' '.join((cmd, '-output-alias-checks', alias_checks))
+        cmd = ' '.join((cmd, '-disable-output', '<', args.prog + '.bc'))
+        rcs_utils.invoke(cmd)
+
     cmd = ng_utils.load_all_plugins('opt')
+    if args.elide_derived or args.hoist_invariant:
+        cmd = ng_utils.load_aa(cmd, args.baseline)
+        cmd = ' '.join((cmd, '-baseline-aa'))
+        cmd = ' '.join((cmd, '-baseline-aa-name', args.baseline))
     # Preparer doesn't preserve IDAssigner, so we put it after
     # -instrument-memory.
     cmd = ' '.join((cmd, '-instrument-memory', '-prepare'))
@@ -30,16 +134,50 @@ if __name__ == '__main__':
         cmd = ' '.join((cmd, '-hook-all-pointers'))
     if args.diagnose:
         cmd = ' '.join((cmd, '-diagnose'))
+    cmd = ' '.join((cmd, '-profile=' + args.profile))
+    if args.drop_ignored:
+        cmd = ' '.join((cmd, '-drop-ignored-records'))
+    if args.elide_local != 'none':
+        cmd = ' '.join((cmd, '-elide-local-allocas=' + args.elide_local))
+    if args.coalesce_frames:
+        cmd = ' '.join((cmd, '-coalesce-frames'))
+    if args.global_table:
+        cmd = ' '.join((cmd, '-global-table'))
+    if args.elide_derived:
+        cmd = ' '.join((cmd, '-elide-derived-pointers',
+                        args.prog + '.derivations'))
+    if args.hoist_invariant:
+        cmd = ' '.join((cmd, '-hoist-invariant-hooks'))
+    if args.batch_hooks:
+        cmd = ' '.join((cmd, '-batch-hooks'))
+    if args.selective is not None:
+        cmd = ' '.join((cmd, '-hook-alias-checks', alias_checks))
     cmd = ' '.join((cmd, '-o', instrumented_bc))
     cmd = ' '.join((cmd, '<', args.prog + '.bc'))
     rcs_utils.invoke(cmd)
 
-    cmd = ' '.join(('clang++', instrumented_bc,
-                    rcs_utils.get_libdir() + '/libDynAAMemoryHooks.a',
-                    '-o', instrumented_exe))
+    if args.inline_hooks:
+        # Merge the hooks into the program, and optimize them together.
+        linked_bc = args.prog + '.inst.linked.bc'
+        cmd = ' '.join(('llvm-link', instrumented_bc,
+                        rcs_utils.get_libdir() + '/DynAAMemoryHooks.bc',
+                        '-o', linked_bc))
+        rcs_utils.invoke(cmd)
+        cmd = ' '.join(('opt', '-O3', '-o', linked_bc, '<', linked_bc))
+        rcs_utils.invoke(cmd)
+        cmd = ' '.join(('clang++', linked_bc, '-o', instrumented_exe))
+    else:
+        cmd = ' '.join(('clang++', instrumented_bc,
+                        rcs_utils.get_libdir() + '/libDynAAMemoryHooks.a',
+                        '-o', instrumented_exe))
     linking_flags = rcs_utils.get_linking_flags(args.prog)
     # Memory hooks use pthread functions.
     if '-pthread' not in linking_flags:
         linking_flags.append('-pthread')
+    # LOG_WRITER=shm uses shm_open, which older glibc has in librt.
+    if '-lrt' not in linking_flags:
+        linking_flags.append('-lrt')
+    if args.zstd:
+        linking_flags.append('-lzstd')
     cmd = ' '.join((cmd, ' '.join(linking_flags)))
     rcs_utils.invoke(cmd)
@@ -106,6 +106,8 @@ if __name__ == '__main__':
                 cmd = ' '.join((cmd, '-online-black-list', func))
 
     cmd = string.join((cmd, '-instrument-memory'))
+    # The offline part is only checked with ng_check_aa.py.
+    cmd = string.join((cmd, '-profile=check-aa'))
     if args.hook_all:
         cmd = string.join((cmd, '-hook-all-pointers'))
     if args.hook_fork:
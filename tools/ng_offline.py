@@ -35,7 +35,7 @@ if __name__ == '__main__':
     args = parser.parse_args()
 
     # ng_hook_mem
-    cmd = ' '.join(('ng_hook_mem.py', args.prog))
+    cmd = ' '.join(('ng_hook_mem.py', args.prog, '--profile', 'check-aa'))
     if args.all:
         cmd = ' '.join((cmd, '--hook-all'))
     rcs_utils.invoke(cmd)
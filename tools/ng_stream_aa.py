@@ -0,0 +1,35 @@
+#!/usr/bin/env python
+
+import argparse
+import rcs_utils
+import ng_utils
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(
+            description = 'Compute dynamic aliases from the records a ' + \
+                    'running program streams (LOG_WRITER=shm)')
+    parser.add_argument('bc', help = 'the bitcode of the program')
+    parser.add_argument('--shm',
+                        help = 'the shared memory object to stream through ' + \
+                                '(/neongoby by default), which the program ' + \
+                                'gets through LOG_SHM',
+                        default = '/neongoby')
+    parser.add_argument('--slots',
+                        help = 'the number of threads that can stream ' + \
+                                '(256 by default)',
+                        type = int,
+                        default = 256)
+    parser.add_argument('--output-ng',
+                        help = 'the file to append each dynamic alias to ' + \
+                                'when it is found (/tmp/ng by default)',
+                        default = '/tmp/ng')
+    args = parser.parse_args()
+
+    cmd = ng_utils.load_all_plugins('opt')
+    cmd = ' '.join((cmd, '-dyn-aa'))
+    cmd = ' '.join((cmd, '-log-shm', args.shm))
+    cmd = ' '.join((cmd, '-log-shm-slots', str(args.slots)))
+    cmd = ' '.join((cmd, '-output-ng', args.output_ng))
+    cmd = ' '.join((cmd, '-disable-output', '<', args.bc))
+
+    rcs_utils.invoke(cmd)